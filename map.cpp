@@ -1,8 +1,39 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cerrno>
+#include <cstdarg>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <queue>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 //---------------------------------------------------------------//
 //                             Types                             //
 //---------------------------------------------------------------//
@@ -15,22 +46,115 @@ struct Color
   uint8_t blue;
 };
 
+static_assert(sizeof(Color) == 3, "A Color must be the 3 bytes of a RGB pixel");
+
+//! How the binary images are written to their file
+enum class Image_output
+{
+  buffered,    //!< Rows encoded in a buffer written with fwrite, works with any kind of file
+  memory_map,  //!< File created at its final length and mapped in memory, the threads encode their rows directly in it
+  pipelined    //!< Bands of rows encoded by the threads while a writer thread writes the previous bands with fwrite
+};
+
+//! What an image saved by Map::save_images shows
+enum class Image_content
+{
+  colors,    //!< Colors of a color picker with the rivers, the roads and the relief (PPM)
+  height,    //!< Raw 16 bits height of each pixel (PGM)
+  moisture   //!< 8 bits moisture of each pixel (PGM)
+};
+
+//! What to wait for once an image is written
+enum class Sync_policy
+{
+  none,   //!< Let the system write the data back when it wants
+  async,  //!< Start writing the data back to the disk, without waiting for it (msync MS_ASYNC on mapped files)
+  sync    //!< Wait for the data to be on the disk (msync MS_SYNC and fsync)
+};
+
+//! Encoding used to write the map images
+enum class Image_format
+{
+  ascii,  //!< Plain PPM (P3), kept for compatibility with older tools
+  binary  //!< Raw PPM (P6), about three times smaller and much faster to write
+};
+
+//! Algorithm computing the heights of a map, see Map::generate_height
+enum class Height_engine
+{
+  diamond_square,  //!< Midpoint displacement, on maps of 2^n + 1 pixels
+  fbm              //!< Sum of octaves of gradient noise (fractional brownian motion), on maps of any size
+};
+
+//! Instruction set of the SIMD kernels, see Fbm_noise
+enum class Simd_level
+{
+  scalar,  //!< No SIMD, the fallback of the other processors
+  sse4_1,  //!< 4 lanes
+  avx2,    //!< 8 lanes
+  avx512,  //!< 16 lanes (AVX-512F)
+  best     //!< The best level supported by the processor
+};
+
+//! Biomes of the whittaker diagram, used to draw the biome maps
+enum class Biome : uint8_t
+{
+  snow,
+  tundra,
+  bare,
+  scorched,
+  taiga,
+  shrubland,
+  temperate_desert,
+  temperate_rain_forest,
+  temperate_deciduous_forest,
+  grassland,
+  tropical_rain_forest,
+  tropical_seasonal_forest,
+  subtropical_desert,
+  count
+};
+
 //---------------------------------------------------------------//
 //                        Random numbers                         //
 //---------------------------------------------------------------//
 
-//! Provide a random number between min and max value
-uint32_t randr(uint32_t min, uint32_t max)
+//! Mix the bits of a 64 bits value (splitmix64 finalizer), every input bit affects every output bit
+inline uint64_t hash_mix(uint64_t value)
 {
-  double scaled = (double)rand() / RAND_MAX;
+  value += 0x9E3779B97F4A7C15ull;
+  value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ull;
+  value = (value ^ (value >> 27)) * 0x94D049BB133111EBull;
+  return value ^ (value >> 31);
+}
+
+//! Counter based random number: the same (seed, level, x, y) always provide the same value, whatever the order of the calls
+//! or the thread computing it.
+inline uint64_t random_hash(uint32_t seed, uint32_t level, uint64_t x, uint64_t y)
+{
+  uint64_t hash = hash_mix((uint64_t(seed) << 32) | level);
+  hash = hash_mix(hash ^ x);
+  return hash_mix(hash ^ y);
+}
 
-  return (max - min + 1) * scaled + min;
+//! Map a random hash to a number between min and max value
+inline int32_t random_range(uint64_t hash, int32_t min, int32_t max)
+{
+  uint64_t range = uint64_t(int64_t(max) - min + 1);
+
+  return min + int32_t(((hash >> 32) * range) >> 32);
 }
 
 //---------------------------------------------------------------//
 //                        Miscellaneous                          //
 //---------------------------------------------------------------//
 
+//! Seconds elapsed since start
+double seconds_since(std::chrono::steady_clock::time_point start)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
 //! Return true if the number is a power of two
 bool is_power_of_two(uint32_t x)
 {
@@ -70,49 +194,6 @@ uint16_t average(int32_t v1, int32_t v2, int32_t v3, int32_t v4)
   return sum / divisor;
 }
 
-//---------------------------------------------------------------//
-//                            Spinner                            //
-//---------------------------------------------------------------//
-
-//! Manage the spinner that can be displayed in the shell to indicated to the user that an operation is ongoing.
-class Spinner
-{
-  public :
-    //! Add the spinner to the shell
-    static void add()
-    {
-      printf("|");
-      spin = 1;
-    }
-
-    //! Update the spinner with the next step
-    static void update()
-    {
-      switch (spin)
-      {
-        case 0 : printf("\b|");  spin = 1; break;
-        case 1 : printf("\b/");  spin = 2; break;
-        case 2 : printf("\b-");  spin = 3; break;
-        case 3 : printf("\b\\"); spin = 4; break;
-        case 4 : printf("\b|");  spin = 5; break;
-        case 5 : printf("\b\\"); spin = 6; break;
-        case 6 : printf("\b-");  spin = 7; break;
-        case 7 : printf("\b/");  spin = 0; break;
-      }
-    }
-
-    //! Remove the spinner from the shell
-    static void remove()
-    {
-      printf("\b");
-    }
-  private :
-    //! Use to mesmerize the spin animation state
-    static uint8_t spin;
-};
-
-uint8_t Spinner::spin = 0;
-
 //---------------------------------------------------------------//
 //                         Configuration                         //
 //---------------------------------------------------------------//
@@ -147,14 +228,58 @@ class Config
     //! Factor used by the level generator, the lower this value is the flatter the map is
     float roughness = 25;
 
-    //! Maximal number of river spring to be generated
+    //! Algorithm computing the heights. Diamond-square rounds map_size down to a power of two plus one, fbm uses it as is.
+    Height_engine height_engine = Height_engine::diamond_square;
+    //! Octaves of noise summed by the fbm heights
+    uint32_t fbm_octaves = 10;
+    //! Wavelength of the first octave of the fbm heights, in part of the map size
+    float fbm_wavelength = 0.5;
+    //! Strength of each octave relative to the previous one
+    float fbm_persistence = 0.5;
+    //! Frequency of each octave relative to the previous one
+    float fbm_lacunarity = 2;
+    //! Instruction set of the fbm kernels, they all give the same heights
+    Simd_level simd_level = Simd_level::best;
+
+    //! Maximal number of river systems to be generated, the largest ones are kept
     uint32_t spring_max = 20;
+    //! Part of the map that must drain through a pixel for a river to start there, the lower the longer the rivers are
+    float river_area = 0.0005;
     //! Size of the rivers
     float rivers_size = 0.5;
 
+    //! Distance to the water, in part of the map size, at which the moisture is divided by e
+    float moisture_distance = 0.03;
+
+    //! Cost added to a road step per unit of slope, the slope being relative to the mean slope of the land
+    float road_slope_cost = 1;
+    //! Cost added to a road step at the highest height, the cost grows linearly from the sea level
+    float road_altitude_cost = 1;
+    //! Cost of a bridge over a river pixel, in pixels of flat road
+    float road_river_cost = 20;
+
+    //! Maximal number of cities, the most suitable sites are taken first
+    uint32_t city_max = 100;
+    //! Minimal distance between two cities, in part of the map size
+    float city_spacing = 0.03;
+    //! Radius of the neighbourhood rated to choose the site of a city, in part of the map size
+    float city_radius = 0.01;
+
     //! Factor used when creating the map image, the more this factore the more the relief cast shadow and the relief appeare crispe. Has only a cosmetic effect.
     float light_level = 75.0;
 
+    //! Direction of the sun used to shade the relief, in degrees clockwise from the north (top of the image)
+    float sun_azimuth = 315;
+    //! Elevation of the sun above the horizon used to shade the relief, in degrees
+    float sun_altitude = 45;
+
+    //! Darken the valleys and the bottom of the cliffs according to how much of the sky they see
+    bool ambient_occlusion = false;
+    //! Number of directions (4 or 8) in which the horizon is searched for the ambient occlusion
+    uint8_t ambient_occlusion_directions = 8;
+    //! How much a fully occluded pixel is darkened [0, 1]
+    float ambient_occlusion_strength = 0.6;
+
     //! Number of entries in height_colors
     uint8_t height_colors_count = 19;
 
@@ -200,14 +325,113 @@ class Config
 
     Color river_color = {9, 120, 171};
 
+    Color road_color = {150, 60, 40};
+
+    //! Colors of the biomes, in the order of Biome. The sea is drawn with negative_height_colors.
+    Color biome_colors[uint8_t(Biome::count)] = {
+      {248, 248, 248},
+      {221, 221, 187},
+      {187, 187, 187},
+      {153, 153, 153},
+      {204, 212, 187},
+      {196, 204, 187},
+      {228, 232, 202},
+      {164, 196, 168},
+      {180, 201, 169},
+      {196, 212, 170},
+      {156, 187, 169},
+      {169, 204, 164},
+      {233, 221, 199}
+    };
+
+    //! Number of height zones and moisture zones of the whittaker diagram
+    static const uint8_t whittaker_heights = 4;
+    static const uint8_t whittaker_moistures = 6;
+
+    //! Biome of each height zone, from the sea level (hot) to the highest height (cold), and each moisture zone, from the
+    //! driest to the wettest. The height plays the role of the temperature.
+    Biome whittaker_diagram[whittaker_heights][whittaker_moistures] = {
+      {Biome::subtropical_desert, Biome::grassland, Biome::tropical_seasonal_forest, Biome::tropical_seasonal_forest, Biome::tropical_rain_forest, Biome::tropical_rain_forest},
+      {Biome::temperate_desert, Biome::grassland, Biome::grassland, Biome::temperate_deciduous_forest, Biome::temperate_deciduous_forest, Biome::temperate_rain_forest},
+      {Biome::temperate_desert, Biome::temperate_desert, Biome::shrubland, Biome::shrubland, Biome::taiga, Biome::taiga},
+      {Biome::scorched, Biome::bare, Biome::tundra, Biome::snow, Biome::snow, Biome::snow}
+    };
+
     bool generate_topographic_map = true;
 
     bool generate_biome_map = true;
 
+    //! Save the raw height map as a 16 bits greyscale image (P5)
+    bool generate_height_map = true;
+
+    //! Save the moisture map as a 8 bits greyscale image (P5)
+    bool generate_moisture_map = true;
+
+    //! Save the topographic map as a pyramid of tiles, see Map::save_tiles
+    bool generate_tiles = false;
+
+    //! Size of the tiles in pixels, a power of two from 2
+    uint32_t tile_size = 256;
+
+    //! Port of the tile server on localhost (see Tile_server), used when server_socket is empty
+    uint32_t server_port = 8080;
+
+    //! Unix socket of the tile server, empty to listen on server_port
+    std::string server_socket = "";
+
+    //! Threads answering the requests of the tile server
+    uint32_t server_threads = 16;
+
+    //! Maps kept in memory by the tile server, the least recently used one is dropped for a new seed
+    uint32_t server_maps = 2;
+
+    //! Bytes of the encoded tiles kept in memory by the tile server
+    uint64_t tile_cache_bytes = 256 << 20;
+
+    //! Encoding used by Map::save
+    Image_format image_format = Image_format::binary;
+
+    //! How the binary images are written
+    Image_output image_output = Image_output::buffered;
+
+    //! Rows of a band of a pipelined image (see Image_output::pipelined)
+    uint32_t band_rows = 64;
+
+    //! Bands of a pipelined image in memory at the same time: the band being encoded and the bands waiting to be written
+    uint32_t bands_in_flight = 4;
+
+    //! What to wait for once an image is written
+    Sync_policy sync_policy = Sync_policy::none;
+
     float smooth_factor = 0.95;
 
     float smooth_pass = 10;
 
+    //! Distance in pixel between the random points of the coarsest level of an unbounded world (see World), a power of two.
+    //! The larger it is the larger the continents are.
+    uint32_t world_cell_size = 2048;
+
+    //! Memory the layers of a map may use, in bytes, 0 for no limit. The layers of larger maps are stored in temporary
+    //! files mapped in memory, the system keeps in RAM only the part of them being processed.
+    uint64_t memory_budget = 0;
+
+    //! Directory of the temporary files storing the layers of the maps larger than memory_budget
+    std::string storage_directory = "/tmp";
+
+    //! File keeping the layers of the map between runs, empty for none. The map is loaded from it when it was generated with
+    //! the same parameters, so only the images are rendered again, otherwise the map is generated and saved in it.
+    std::string map_file = "";
+
+    //! Store a checksum of each tile of the layers in the map files and check them when loading
+    bool map_file_checksums = true;
+
+    //! Number of threads used to generate and save the map, 0 to use every core of the computer
+    uint32_t threads = 0;
+
+    //! File receiving the trace of the stages when the program exits, in the Chrome trace format (chrome://tracing,
+    //! Perfetto). Empty to not trace.
+    std::string trace_file = "";
+
   private:
     Config() { }
     Config(const Config &rhs);
@@ -215,616 +439,6978 @@ class Config
 };
 
 //---------------------------------------------------------------//
-//                       Color Management                        //
+//                           Threading                           //
 //---------------------------------------------------------------//
-//! Color picker is used to draw the map, it's convert an height and moisture to a color.
-class Color_picker
+
+//! Pool of worker threads shared by all the algorithms.
+//! This class is a singleton, its size is taken from the configuration when first used.
+class Thread_pool
 {
   public :
-    virtual Color color(uint16_t height, uint8_t moisture) const = 0;
-};
+    typedef std::function<void(uint64_t begin, uint64_t end)> Job;
 
-//! Convert an altitude into a color, used to draw topographic maps.
-class Topographic_color_picker : public Color_picker
-{
-  public:   
-    //! /param min Minimal height of the map, use to set the deepest color
-    //! /param max Minimal height of the map, use to set the highest color
-    Topographic_color_picker (uint16_t min = 0, uint16_t max = 65535)
-    {    
-      printf("Computing topographic colors...");
-      
-      colors = new Color[65535];
-      
-      for (uint16_t i = 0 ; i < sizeof(colors) ; i++)
+    inline static Thread_pool & get()
+    {
+      static Thread_pool singleton;
+      return singleton;
+    }
+
+    //! Number of threads running the jobs, including the calling thread
+    uint32_t size() const
+    {
+      return workers.size() + 1;
+    }
+
+    //! Change the number of threads, 0 to use every core of the computer
+    void resize(uint32_t threads)
+    {
+      stop();
+
+      if (threads == 0)
       {
-        colors[i] = Color{0, 0, 0};
+        threads = std::max(1u, std::thread::hardware_concurrency());
       }
-      
-      uint8_t index = 0;
-      uint16_t offset = Config::get().ocean_height;
-      uint16_t step = (offset - min) / Config::get().negative_height_colors_count;
 
-      Color color_lower = Config::get().negative_height_colors[index];
-
-      for (uint16_t height = min ; height < offset ; height++)
-      {               
-        if (height > (index + 1) * step)
-        {
-           color_lower = Config::get().negative_height_colors[++index];
-        }
-        
-        Color color_greater;        
-        //when the end of the color list is reach, use the last value as greater value
-        if (index + 1 == Config::get().negative_height_colors_count)
-        {
-          color_greater = color_lower;
-        }
-        else
-        {
-          color_greater = Config::get().negative_height_colors[index + 1];
-        }
-     
-        colors[height].red = color_lower.red + double(double(color_greater.red - color_lower.red) / double(step)) * (height - index * step);
-        colors[height].green = color_lower.green + double(double(color_greater.green - color_lower.green) / double(step)) * (height - index * step);
-        colors[height].blue = color_lower.blue + double(double(color_greater.blue - color_lower.blue) / double(step)) * (height - index * step);
+      for (uint32_t i = 1 ; i < threads ; i++)
+      {
+        workers.push_back(std::thread(&Thread_pool::work, this));
       }
-      
-      index = 0;
-      step = (max - offset) / Config::get().height_colors_count;
-      
-      color_lower = Config::get().height_colors[index];
-      for (uint16_t height = offset ; height < max ; height++)
-      {       
-        if (height > offset + (index + 1) * step)
-        {
-          color_lower = Config::get().height_colors[++index];
-        }
-        
-        Color color_greater;
-        //when the end of the color list is reach, use the last value as greater value
-        if (index + 1 == Config::get().height_colors_count)
-        {
-          color_greater = color_lower;
-        }
-        else
-        {
-          color_greater = Config::get().height_colors[index + 1];
-        }
-        
-        colors[height].red = color_lower.red + double(double(color_greater.red - color_lower.red) / double(step)) * (height - offset - index * step);
-        colors[height].green = color_lower.green + double(double(color_greater.green - color_lower.green) / double(step)) * (height - offset - index * step);
-        colors[height].blue = color_lower.blue + double(double(color_greater.blue - color_lower.blue) / double(step)) * (height - offset - index * step);
-      }      
-      printf("done\n");
     }
 
-    ~Topographic_color_picker()
+    //! Split [begin, end) in disjoint ranges and call the job on each of them from several threads.
+    //! Return once the whole range is processed. A job started from inside another job runs on the calling thread only.
+    void parallel_for(uint64_t begin, uint64_t end, const Job & job)
     {
-      delete colors;
-    }
+      if (begin >= end)
+      {
+        return;
+      }
 
-    //! Topographic map is build only by using the altitude
-    Color color(uint16_t height, uint8_t /*moisture*/) const
-    {
-      if (colors != nullptr)
+      if (workers.empty() or inside_job or (end - begin == 1))
       {
-        return colors[height];
+        job(begin, end);
+        return;
       }
-      return Color{0, 0, 0};    
-    }
-  
-  private:   
-    Color * colors;
-};
 
-//! Use a whittaker diagram to provide color acording to height (temperature) and moisture
-class Biome_color_picker : public Color_picker
-{
-  Color color(uint16_t /*height*/, uint8_t /*moisture*/) const
-  {
-    //TODO
-    return Color{0, 0, 0};
-  }
-};
+      //Only one job at a time is shared with the workers
+      std::lock_guard<std::mutex> job_lock(job_mutex);
 
-//---------------------------------------------------------------//
-//                         Map generator                         //
-//---------------------------------------------------------------//
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return active == 0; });
 
-class Map
-{
-  public:
-    Map()
-    {
-      init();
-      generate_height();
-      height_smooth();
-      generate_rivers();
-      generate_cities();
-      generate_road();
+        current = &job;
+        current_begin = begin;
+        current_end = end;
+        chunk_count = std::min<uint64_t>(end - begin, chunks_per_thread * size());
+        next_chunk = 0;
+        pending_chunks = chunk_count;
+        generation++;
+      }
+      wake.notify_all();
+
+      run_chunks();
+
+      std::unique_lock<std::mutex> lock(mutex);
+      done.wait(lock, [this] { return (pending_chunks == 0) and (active == 0); });
     }
-    
-    ~Map()
+
+  private:
+    //! Split each job in more chunks than threads, so a slow thread does not delay the others
+    static const uint32_t chunks_per_thread = 4;
+
+    Thread_pool()
     {
-      delete _height;
+      resize(Config::get().threads);
     }
-      
-    //! Save the map to a file. Use the color picker to obtain the colors.
-    void save(const Color_picker * color_picker, std::string name)
+
+    ~Thread_pool()
     {
-      if (color_picker == nullptr)
-      {
-        printf("Error : Cannot save map whithout color picker\n");
-        exit(1);
-      }
+      stop();
+    }
 
-      printf("Saving map...");
-      Spinner::add();
-    
-      FILE * fp;
+    Thread_pool(const Thread_pool &rhs);
+    Thread_pool &operator=(const Thread_pool &rhs);
 
-      fp = fopen ((name + ".ppm").c_str(), "w");
-      fprintf(fp, "P3\n");
-      fprintf(fp, "%d %d\n", size, size);
-      fprintf(fp, "255\n");
+    //! Main loop of the worker threads
+    void work()
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      uint64_t seen = generation;
 
-      for (uint32_t x = 0 ; x < size ; x++)
+      while (true)
       {
-        //Update spinner only each line to improve performance
-        Spinner::update();
+        wake.wait(lock, [this, seen] { return stopping or (generation != seen); });
 
-        for (uint32_t y = 0 ; y < size ; y++)
+        if (stopping)
         {
-          Color color;
-          // if the pixel is water (river or lac, use dedicated color, otherwize obtain color from height)
-          if (water(x, y) != 0)
-          {
-            color = Config::get().river_color;
-          }
-          else
-          {
-            // Get color from the color picker
-            color = color_picker->color(height(x, y), moisture(x, y));
-          }
-
-          //The color is altered by the relief
-          int32_t west_height = height(x + 1, y);
-          int32_t south_height = height(x, y + 1);
+          return;
+        }
 
-          //If the west or south pixel are out of the map, do not change color for this pixel
-          if ((west_height != -1) and (south_height != -1))
-          {
-            int32_t delta = west_height + south_height - 2 * height(x, y);
-            float factor = float(delta) / (65535.0 / Config::get().light_level);
+        seen = generation;
+        active++;
+        lock.unlock();
 
-            //Reduce the light under water to obtain a better looking result.
-            if (height(x, y) < (int32_t)Config::get().ocean_height)
-            {
-              factor = factor / 3;
-            }
+        run_chunks();
 
-            if (delta >= 0)
-            {
-              color.red = color.red * (1.0 - factor);
-              color.green = color.green * (1.0 - factor);
-              color.blue = color.blue * (1.0 - factor);
-            }
-            else
-            {
-              color.red = color.red + (factor * (255 - color.red));
-              color.green = color.green + (factor * (255 - color.green));
-              color.blue = color.blue + (factor * (255 - color.blue));
-            }
-          }
-          
-          fprintf(fp, "%d %d %d ", color.red, color.green, color.blue);
+        lock.lock();
+        active--;
+        if (active == 0)
+        {
+          done.notify_all();
         }
-        fprintf(fp, "\n");
       }
-
-      fclose(fp);
-      
-      Spinner::remove();
-      printf("done\n");
     }
 
-    uint16_t height_max()
+    //! Process chunks of the current job until none is left
+    void run_chunks()
     {
-      uint16_t max = 0;
-      for (uint32_t i = 0 ; i < (uint32_t)(size * size) ; i++)
+      while (true)
       {
-        if (_height[i] > max)
+        uint64_t chunk = next_chunk++;
+
+        if (chunk >= chunk_count)
         {
-          max = _height[i];
+          return;
+        }
+
+        uint64_t length = current_end - current_begin;
+        uint64_t begin = current_begin + length * chunk / chunk_count;
+        uint64_t end = current_begin + length * (chunk + 1) / chunk_count;
+
+        inside_job = true;
+        (*current)(begin, end);
+        inside_job = false;
+
+        if (--pending_chunks == 0)
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          done.notify_all();
         }
       }
-      return max;
     }
 
-    uint16_t height_min()
+    //! Stop and join all the workers
+    void stop()
     {
-      uint16_t min = 65535;
-      for (uint32_t i = 0 ; i < (uint32_t)(size * size) ; i++)
       {
-        if (_height[i] < min)
-        {
-          min = _height[i];
-        }
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
       }
-      return min;
+      wake.notify_all();
+
+      for (std::thread & worker : workers)
+      {
+        worker.join();
+      }
+      workers.clear();
+      stopping = false;
     }
 
-  private:
-    struct Pixel_height
+    std::vector<std::thread> workers;
+    std::mutex job_mutex;
+    std::mutex mutex;
+    std::condition_variable wake;   //Signaled when a job is available or the pool is stopping
+    std::condition_variable done;   //Signaled when a worker is idle or the last chunk is processed
+
+    const Job * current = nullptr;
+    uint64_t current_begin = 0;
+    uint64_t current_end = 0;
+    uint64_t chunk_count = 0;
+    std::atomic<uint64_t> next_chunk{0};
+    std::atomic<uint64_t> pending_chunks{0};
+    uint64_t generation = 0;
+    uint32_t active = 0;
+    bool stopping = false;
+
+    static thread_local bool inside_job;
+};
+
+thread_local bool Thread_pool::inside_job = false;
+
+//---------------------------------------------------------------//
+//                           Progress                            //
+//---------------------------------------------------------------//
+
+//! Progress of the stages on the console, and trace of their durations.
+//! The stages count their work in an atomic counter, from any thread and without any lock. A reporter thread prints the
+//! progress of the current stage at most every report_interval, so the console costs a few writes per stage whatever its
+//! size. When Config::trace_file is set, every stage is recorded and the trace is written when the program exits.
+//! This class is a singleton, see Stage_timer to time a stage.
+class Progress
+{
+  public :
+    inline static Progress & get()
     {
-      uint16_t x;
-      uint16_t y;
-      uint16_t height;
-    };
+      static Progress singleton;
+      return singleton;
+    }
+
+    //! Hide the stages run by the calling thread from the console, used when several maps are generated at the same time.
+    //! They are still traced.
+    static thread_local bool quiet;
+
+  private :
+    friend class Stage_timer;
 
-    void init()
+    //! A stage in the Chrome trace format, times in microseconds since the start of the program
+    struct Event
     {
-      printf("Initializing map generator...");
+      std::string name;
+      uint32_t thread;
+      uint64_t begin;
+      uint64_t duration;
+    };
 
-      //Map size must be a power of two + 1
-      uint16_t map_size = Config::get().map_size;
+    //! Minimum delay between two updates of the progress on the console
+    static constexpr std::chrono::milliseconds report_interval{200};
 
-      //If not a power of two, find the nearest power of two by decrementing
-      while(not is_power_of_two(map_size))
+    Progress() : trace_file(Config::get().trace_file), origin(std::chrono::steady_clock::now())
+    {
+      reporter = std::thread(&Progress::report, this);
+    }
+
+    ~Progress()
+    {
       {
-        map_size--;
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
       }
+      wake.notify_all();
+      reporter.join();
 
-      //The + 1
-      map_size++;
+      save_trace();
+    }
 
-      size = map_size;
+    Progress(const Progress &rhs);
+    Progress &operator=(const Progress &rhs);
 
-      _height = new uint16_t [size * size];
+    //! Show a stage on the console if no other stage is shown. Return true if it is shown.
+    bool show(const char * label, uint64_t steps)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
 
-      //Set to zero the height
-      for (uint32_t i = 0 ; i < (uint32_t)(size * size) ; i++)
+      if (shown != nullptr)
       {
-        _height[i] = 0;
+        return false;
       }
 
-      _water = new uint8_t [size * size];
+      shown = label;
+      total = steps;
+      done = 0;
+      printed = UINT32_MAX;
+      next_report = std::chrono::steady_clock::now() + report_interval;
+      printf("%s...", label);
+      wake.notify_all();
+      return true;
+    }
+
+    //! Remove the shown stage from the console
+    void hide(double seconds)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
 
-      //Set to zero the water
-      for (uint32_t i = 0 ; i < (uint32_t)(size * size) ; i++)
+      if (printed != UINT32_MAX)
       {
-        _water[i] = 0;
+        printf("\r%s...", shown);
       }
+      printf("done (%.2f s)\n", seconds);
+      shown = nullptr;
+    }
 
-      _moisture = new uint8_t [size * size];
+    //! Main loop of the reporter thread
+    void report()
+    {
+      std::unique_lock<std::mutex> lock(mutex);
 
-      //Set to zero the water
-      for (uint32_t i = 0 ; i < (uint32_t)(size * size) ; i++)
+      while (not stopping)
       {
-        _moisture[i] = 0;
-      }
+        if ((shown == nullptr) or (total == 0))
+        {
+          wake.wait(lock);
+          continue;
+        }
 
-      printf("done\n");
-    }
+        //Woken up early when the stage changes
+        wake.wait_until(lock, next_report);
 
-    //use Diamond-square algorithm to compote the height map
-    //http://en.wikipedia.org/wiki/Diamond-square_algorithm
-    void generate_height()
-    { 
-      printf("Computing height map...");
-      Spinner::add();
-             
-      //Set the initial corners
-      height(0, 0, Config::get().left_top_corner_height);
-      height(0, size-1, Config::get().right_top_corner_height);
-      height(size - 1, 0, Config::get().left_bottom_corner_height);
-      height(size - 1, size-1, Config::get().right_bottom_corner_height);
-      
-      //Each step of the algorithme, the map is splitted in smaler squares
-      for (int32_t square_size = size ; square_size > 2 ; square_size =  square_size / 2 + 1)
-      {      
-        Spinner::update();
-        //For each squares, compute it's center coordinates
-        for (uint32_t x = square_size / 2 ; x < size ; x = x + square_size - 1)
-        {         
-          for (uint32_t y = square_size / 2 ; y < size ; y = y + square_size - 1)
-          {           
-            //Random offset
-            uint16_t offset = randr(- Config::get().roughness * square_size, Config::get().roughness * square_size);
-            
-            //center value equal the mean of the square corners
-            height(x, y, ( height(x - square_size / 2, y - square_size / 2)
-                         + height(x + square_size / 2, y - square_size / 2)
-                         + height(x - square_size / 2, y + square_size / 2)
-                         + height(x + square_size / 2, y + square_size / 2)) / 4 + offset);
-          }
-        }
-        
-        //For each diamond, compute it's center coordinates
-        for (int32_t x = 0 ; x < size ; x = x + square_size / 2)
+        if ((shown != nullptr) and (total != 0) and (std::chrono::steady_clock::now() >= next_report))
         {
-          for (int32_t y = square_size / 2 - x % (square_size - 1) ; y < size ; y = y + square_size - 1)
+          uint32_t percent = std::min<uint64_t>(100, done.load(std::memory_order_relaxed) * 100 / total);
+
+          if (percent != printed)
           {
-            //Random offset
-            uint16_t offset = randr(- Config::get().roughness * square_size, Config::get().roughness * square_size);
-            
-            //center value equal the mean of the diamond corners
-            int32_t top = -1;
-            int32_t right = -1;
-            int32_t bottom = -1;
-            int32_t left = -1;
-            
-            if (((x >= 0) and (x < size)) and ((y - square_size / 2 >= 0) and (y - square_size / 2 < size)))
+            printf("\r%s...%3u%%", shown, percent);
+            printed = percent;
+          }
+          next_report += report_interval;
+        }
+      }
+    }
+
+    //! Keep a stage for the trace
+    void record(const char * name, std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point end)
+    {
+      if (trace_file.empty())
+      {
+        return;
+      }
+
+      //The threads are numbered in the order they record their first stage
+      static std::atomic<uint32_t> threads(0);
+      static thread_local uint32_t thread = ++threads;
+
+      std::lock_guard<std::mutex> lock(trace_mutex);
+      events.push_back(Event{name, thread, microseconds(begin), microseconds(end) - microseconds(begin)});
+    }
+
+    //! Write the stages recorded to the trace file
+    void save_trace()
+    {
+      if (trace_file.empty())
+      {
+        return;
+      }
+
+      FILE * fp = fopen(trace_file.c_str(), "w");
+      if (fp == nullptr)
+      {
+        printf("Error : Cannot open %s\n", trace_file.c_str());
+        return;
+      }
+
+      fprintf(fp, "{\"traceEvents\": [");
+      for (uint64_t i = 0 ; i < events.size() ; i++)
+      {
+        const Event & event = events[i];
+        fprintf(fp, "%s\n  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %llu, \"dur\": %llu}",
+                (i == 0) ? "" : ",", event.name.c_str(), event.thread, (unsigned long long)event.begin,
+                (unsigned long long)event.duration);
+      }
+      fprintf(fp, "\n]}\n");
+      fclose(fp);
+    }
+
+    uint64_t microseconds(std::chrono::steady_clock::time_point time) const
+    {
+      return std::chrono::duration_cast<std::chrono::microseconds>(time - origin).count();
+    }
+
+    std::mutex mutex;  //Protect the console and the shown stage
+    std::condition_variable wake;
+    std::thread reporter;
+    bool stopping = false;
+
+    const char * shown = nullptr;  //Label of the stage on the console, if any
+    uint64_t total = 0;  //Steps of the shown stage, 0 if it does not count them
+    std::atomic<uint64_t> done{0};  //Steps of the shown stage done
+    uint32_t printed = UINT32_MAX;  //Percentage on the console
+    std::chrono::steady_clock::time_point next_report;
+
+    std::string trace_file;
+    std::chrono::steady_clock::time_point origin;
+    std::mutex trace_mutex;
+    std::vector<Event> events;
+};
+
+constexpr std::chrono::milliseconds Progress::report_interval;
+thread_local bool Progress::quiet = false;
+
+//! Scoped timer of a stage: the stage is shown on the console with its progress while the timer lives, then traced.
+//! The stage announces the number of steps of its work, and counts them with advance as it goes.
+class Stage_timer
+{
+  public :
+    Stage_timer(const char * label, uint64_t steps = 0) : label(label)
+    {
+      Progress & progress = Progress::get();
+      shown = (not Progress::quiet) and progress.show(label, steps);
+      begin = std::chrono::steady_clock::now();
+    }
+
+    ~Stage_timer()
+    {
+      std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+      if (shown)
+      {
+        Progress::get().hide(std::chrono::duration<double>(end - begin).count());
+      }
+      Progress::get().record(label, begin, end);
+    }
+
+    //! Count steps of the work done, from any thread
+    void advance(uint64_t steps = 1)
+    {
+      if (shown)
+      {
+        Progress::get().done.fetch_add(steps, std::memory_order_relaxed);
+      }
+    }
+
+  private :
+    Stage_timer(const Stage_timer &rhs);
+    Stage_timer &operator=(const Stage_timer &rhs);
+
+    const char * label;
+    std::chrono::steady_clock::time_point begin;
+    bool shown;
+};
+
+//---------------------------------------------------------------//
+//                       Color Management                        //
+//---------------------------------------------------------------//
+//! Color picker is used to draw the map, it's convert heights and moistures to colors.
+//! The conversion is done a row at a time: one virtual call per row, the loop over the pixels is inlined in each picker.
+class Color_picker
+{
+  public :
+    virtual ~Color_picker() { }
+
+    //! Convert count heights and moistures to colors
+    virtual void colorize(const uint16_t * heights, const uint8_t * moistures, uint32_t count, Color * colors) const = 0;
+};
+
+//! Mix the colors of a palette into a hash, used to find the tables computed from the palette
+uint64_t palette_hash(uint64_t hash, const Color * colors, uint8_t count)
+{
+  for (uint8_t i = 0 ; i < count ; i++)
+  {
+    hash = hash_mix(hash ^ ((uint64_t(colors[i].red) << 16) | (uint64_t(colors[i].green) << 8) | colors[i].blue));
+  }
+  return hash_mix(hash ^ count);
+}
+
+//! Convert an altitude into a color, used to draw topographic maps.
+//! The colors of every altitude are computed once per palette and shared by all the pickers using the same palette.
+class Topographic_color_picker final : public Color_picker
+{
+  public:   
+    //! /param min Minimal height of the map, use to set the deepest color
+    //! /param max Minimal height of the map, use to set the highest color
+    Topographic_color_picker (uint16_t min = 0, uint16_t max = 65535) : colors(table(min, max))
+    {
+    }
+
+    //! Topographic map is build only by using the altitude
+    void colorize(const uint16_t * heights, const uint8_t * /*moistures*/, uint32_t count, Color * colors) const
+    {
+      const Color * table = this->colors->data();
+
+      for (uint32_t i = 0 ; i < count ; i++)
+      {
+        colors[i] = table[heights[i]];
+      }
+    }
+  
+  private:
+    //! Color of each of the 65536 altitudes
+    typedef std::vector<Color> Table;
+
+    //! Table of the current palette, built on first use
+    static std::shared_ptr<const Table> table(uint16_t min, uint16_t max)
+    {
+      static std::mutex mutex;
+      static std::unordered_map<uint64_t, std::shared_ptr<const Table>> tables;
+
+      //The palette is identified by everything the table is computed from
+      const Config & config = Config::get();
+      uint64_t key = hash_mix((uint64_t(min) << 48) | (uint64_t(max) << 32) | config.ocean_height);
+      key = palette_hash(key, config.negative_height_colors, config.negative_height_colors_count);
+      key = palette_hash(key, config.height_colors, config.height_colors_count);
+
+      std::lock_guard<std::mutex> lock(mutex);
+
+      std::shared_ptr<const Table> & table = tables[key];
+      if (table == nullptr)
+      {
+        table = build(min, max);
+      }
+      return table;
+    }
+
+    //! Interpolate the colors of the palette: under the sea level between negative_height_colors, above between height_colors
+    static std::shared_ptr<const Table> build(uint16_t min, uint16_t max)
+    {
+      Stage_timer stage("Computing topographic colors");
+
+      std::shared_ptr<Table> colors = std::make_shared<Table>(65536, Color{0, 0, 0});
+      uint32_t offset = Config::get().ocean_height;
+
+      interpolate(*colors, min, std::max<uint32_t>(min, offset), Config::get().negative_height_colors, Config::get().negative_height_colors_count);
+      interpolate(*colors, std::max<uint32_t>(min, offset), uint32_t(max) + 1, Config::get().height_colors, Config::get().height_colors_count);
+
+      return colors;
+    }
+
+    //! Fill the heights [first, end) of the table with a gradient going through the palette colors.
+    //! The range is split in count steps, each step going from a palette color to the next one.
+    static void interpolate(Table & table, uint32_t first, uint32_t end, const Color * palette, uint8_t count)
+    {
+      if ((first >= end) or (count == 0))
+      {
+        return;
+      }
+
+      int32_t step = std::max<int32_t>(1, (end - first) / count);
+
+      for (uint32_t height = first ; height < end ; height++)
+      {
+        //The last steps take the remaining heights, and when the end of the color list is reach, use the last value as greater value
+        uint32_t index = std::min<uint32_t>((height - first) / step, count - 1);
+        const Color & color_lower = palette[index];
+        const Color & color_greater = palette[std::min<uint32_t>(index + 1, count - 1)];
+        int32_t position = std::min<int32_t>(height - first - index * step, step);
+
+        table[height].red = color_lower.red + (color_greater.red - color_lower.red) * position / step;
+        table[height].green = color_lower.green + (color_greater.green - color_lower.green) * position / step;
+        table[height].blue = color_lower.blue + (color_greater.blue - color_lower.blue) * position / step;
+      }
+    }
+
+    std::shared_ptr<const Table> colors;
+};
+
+//! Use a whittaker diagram to provide color acording to height (temperature) and moisture.
+//! The diagram is sampled once per palette in a table of height buckets and moisture buckets small enough to stay in the
+//! cache. The bucket of each of the 65536 heights is in a second table, so the sea level is exact whatever the bucket size.
+//! Each pixel is then two lookups, without any branch.
+class Biome_color_picker final : public Color_picker
+{
+  public:
+    Biome_color_picker() : tables(table())
+    {
+    }
+
+    void colorize(const uint16_t * heights, const uint8_t * moistures, uint32_t count, Color * colors) const
+    {
+      const uint8_t * buckets = tables->buckets.data();
+      const Color * table = tables->colors.data();
+
+      for (uint32_t i = 0 ; i < count ; i++)
+      {
+        colors[i] = table[buckets[heights[i]] * moisture_buckets + (moistures[i] >> moisture_shift)];
+      }
+    }
+
+  private:
+    //! Number of height buckets under and above the sea level
+    static const uint32_t sea_buckets = 16;
+    static const uint32_t land_buckets = 64;
+    //! The moisture is quantized to moisture_buckets buckets
+    static const uint32_t moisture_shift = 2;
+    static const uint32_t moisture_buckets = 256 >> moisture_shift;
+
+    struct Tables
+    {
+      //! Height bucket of each of the 65536 heights
+      std::vector<uint8_t> buckets;
+      //! Color of each height bucket and moisture bucket
+      std::vector<Color> colors;
+    };
+
+    //! Tables of the current palette and diagram, built on first use
+    static std::shared_ptr<const Tables> table()
+    {
+      static std::mutex mutex;
+      static std::unordered_map<uint64_t, std::shared_ptr<const Tables>> tables;
+
+      const Config & config = Config::get();
+      uint64_t key = hash_mix(config.ocean_height);
+      key = palette_hash(key, config.negative_height_colors, config.negative_height_colors_count);
+      key = palette_hash(key, config.biome_colors, uint8_t(Biome::count));
+      for (uint8_t zone = 0 ; zone < Config::whittaker_heights ; zone++)
+      {
+        for (uint8_t moisture = 0 ; moisture < Config::whittaker_moistures ; moisture++)
+        {
+          key = hash_mix(key ^ uint8_t(config.whittaker_diagram[zone][moisture]));
+        }
+      }
+
+      std::lock_guard<std::mutex> lock(mutex);
+
+      std::shared_ptr<const Tables> & table = tables[key];
+      if (table == nullptr)
+      {
+        table = build();
+      }
+      return table;
+    }
+
+    //! Sample the diagram: the sea buckets go through negative_height_colors whatever the moisture, the land buckets are
+    //! spread from the sea level to the highest height over the height zones of the diagram
+    static std::shared_ptr<const Tables> build()
+    {
+      Stage_timer stage("Computing biome colors");
+
+      const Config & config = Config::get();
+      std::shared_ptr<Tables> tables = std::make_shared<Tables>();
+      uint32_t ocean_height = config.ocean_height;
+
+      tables->buckets.resize(65536);
+      for (uint32_t height = 0 ; height < 65536 ; height++)
+      {
+        tables->buckets[height] = (height < ocean_height) ? height * sea_buckets / ocean_height
+                                                          : sea_buckets + (height - ocean_height) * land_buckets / (65536 - ocean_height);
+      }
+
+      tables->colors.resize((sea_buckets + land_buckets) * moisture_buckets);
+      for (uint32_t bucket = 0 ; bucket < sea_buckets + land_buckets ; bucket++)
+      {
+        for (uint32_t moisture = 0 ; moisture < moisture_buckets ; moisture++)
+        {
+          Color color;
+          if (bucket < sea_buckets)
+          {
+            color = config.negative_height_colors[bucket * config.negative_height_colors_count / sea_buckets];
+          }
+          else
+          {
+            uint32_t zone = (bucket - sea_buckets) * Config::whittaker_heights / land_buckets;
+            Biome biome = config.whittaker_diagram[zone][moisture * Config::whittaker_moistures / moisture_buckets];
+            color = config.biome_colors[uint8_t(biome)];
+          }
+          tables->colors[bucket * moisture_buckets + moisture] = color;
+        }
+      }
+
+      return tables;
+    }
+
+    std::shared_ptr<const Tables> tables;
+};
+
+//---------------------------------------------------------------//
+//                        Height smoothing                       //
+//---------------------------------------------------------------//
+
+//! Weights of the blend between a pixel and its neighbour, computed once per smoothing
+struct Smooth_weights
+{
+  Smooth_weights(float smooth_factor) : neighbor(1.0f - smooth_factor), current(smooth_factor) { }
+
+  float neighbor;
+  float current;
+};
+
+//! current[i] = neighbor[i] * (1 - smooth_factor) + current[i] * smooth_factor for count pixels.
+//! The SIMD and scalar paths do the same float operations, so they give the same result.
+inline void smooth_span(const uint16_t * neighbor, uint16_t * current, uint32_t count, const Smooth_weights & weights)
+{
+  uint32_t i = 0;
+
+#ifdef __SSE2__
+  const __m128 neighbor_weight = _mm_set1_ps(weights.neighbor);
+  const __m128 current_weight = _mm_set1_ps(weights.current);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i bias = _mm_set1_epi32(32768);
+  const __m128i sign = _mm_set1_epi16(int16_t(0x8000));
+
+  for ( ; i + 8 <= count ; i += 8)
+  {
+    __m128i neighbors = _mm_loadu_si128((const __m128i *)(neighbor + i));
+    __m128i currents = _mm_loadu_si128((const __m128i *)(current + i));
+
+    __m128 low = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(neighbors, zero)), neighbor_weight),
+                            _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(currents, zero)), current_weight));
+    __m128 high = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(neighbors, zero)), neighbor_weight),
+                             _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(currents, zero)), current_weight));
+
+    //SSE2 can only pack signed values: shift to the signed range, pack, then shift back
+    __m128i packed = _mm_packs_epi32(_mm_sub_epi32(_mm_cvttps_epi32(low), bias), _mm_sub_epi32(_mm_cvttps_epi32(high), bias));
+    _mm_storeu_si128((__m128i *)(current + i), _mm_xor_si128(packed, sign));
+  }
+#endif
+
+  for ( ; i < count ; i++)
+  {
+    current[i] = float(neighbor[i]) * weights.neighbor + float(current[i]) * weights.current;
+  }
+}
+
+//---------------------------------------------------------------//
+//                         Fractal noise                         //
+//---------------------------------------------------------------//
+
+//! Octave of Fbm_noise. The values are computed once and shared by every kernel, so they all compute the same heights.
+struct Fbm_octave
+{
+  float frequency;  //Cycles of the grid per pixel
+  float shift;  //Shift of the grid, so the octaves do not share the same origin
+  float amplitude;  //Height of a unit of noise
+  uint32_t seed;
+};
+
+//! Values of an octave shared by the pixels of a row
+struct Fbm_row
+{
+  float fy;  //Position in the cell
+  float v;  //Weight of the bottom corners
+  uint32_t row0;  //Hash of the top and bottom rows of the grid
+  uint32_t row1;
+};
+
+//! Values of the octaves for the row x, computed once for all the kernels
+__attribute__((optimize("fp-contract=off")))
+inline void fbm_rows(const Fbm_octave * octaves, uint32_t octave_count, uint32_t x, Fbm_row * rows)
+{
+  for (uint32_t octave = 0 ; octave < octave_count ; octave++)
+  {
+    const Fbm_octave & o = octaves[octave];
+
+    //The coordinates are positive, so the truncation is the floor
+    float row = float(x) * o.frequency + o.shift;
+    uint32_t cell_row = uint32_t(int32_t(row));
+    float fy = row - float(int32_t(cell_row));
+
+    rows[octave].fy = fy;
+    rows[octave].v = fy * fy * fy * ((fy * 6.0f - 15.0f) * fy + 10.0f);
+    rows[octave].row0 = o.seed ^ (cell_row * 0x165667B1u);
+    rows[octave].row1 = o.seed ^ ((cell_row + 1) * 0x165667B1u);
+  }
+}
+
+//! Sum of the octaves for the pixels [first, end) of a row, written as heights. The lanes of F, U and I (float, unsigned
+//! and signed vectors of the same width) are consecutive pixels, a single lane is the scalar fallback. Each lane does the same
+//! IEEE operations in the same order, without contraction to FMA (see the callers), so the result does not depend on the width.
+//! \return End of the pixels computed, the pixels of an incomplete vector are left to a narrower kernel
+template <typename F, typename U, typename I>
+__attribute__((always_inline)) inline uint32_t fbm_kernel(const Fbm_octave * octaves, const Fbm_row * rows,
+                                                          uint32_t octave_count, uint32_t first, uint32_t end, float base,
+                                                          uint16_t * heights)
+{
+  const uint32_t width = sizeof(F) / sizeof(float);
+  uint32_t y = first;
+
+  for ( ; y + width <= end ; y += width)
+  {
+    U columns;
+    for (uint32_t lane = 0 ; lane < width ; lane++)
+    {
+      columns[lane] = y + lane;
+    }
+
+    F sum = {};
+
+    for (uint32_t octave = 0 ; octave < octave_count ; octave++)
+    {
+      const Fbm_octave & o = octaves[octave];
+      const float fy = rows[octave].fy, fy1 = fy - 1.0f, v = rows[octave].v;
+      const uint32_t row0 = rows[octave].row0, row1 = rows[octave].row1;
+
+      F column = __builtin_convertvector((I)columns, F) * o.frequency + o.shift;
+      U cell_column = (U)__builtin_convertvector(column, I);
+      F fx = column - __builtin_convertvector((I)cell_column, F);
+      F fx1 = fx - 1.0f;
+      F u = fx * fx * fx * ((fx * 6.0f - 15.0f) * fx + 10.0f);
+
+      U column0 = cell_column * 0x27D4EB2Du;
+      U column1 = column0 + 0x27D4EB2Du;
+
+      //Hash of the corners of the cell, the gradient of a corner is two bytes of its hash
+      U hashes[4] = {column0 ^ row0, column1 ^ row0, column0 ^ row1, column1 ^ row1};
+      F dots[4];
+      const F * dxs[4] = {&fx, &fx1, &fx, &fx1};
+      const float dys[4] = {fy, fy, fy1, fy1};
+
+      for (uint32_t corner = 0 ; corner < 4 ; corner++)
+      {
+        U h = hashes[corner];
+        h = (h ^ (h >> 15)) * 0x2C1B3C6Du;
+        h = (h ^ (h >> 12)) * 0x297A2D39u;
+        h = h ^ (h >> 15);
+
+        F gradient_x = __builtin_convertvector((I)(h & 0xFFu), F) - 127.5f;
+        F gradient_y = __builtin_convertvector((I)((h >> 8) & 0xFFu), F) - 127.5f;
+        dots[corner] = gradient_x * *dxs[corner] + gradient_y * dys[corner];
+      }
+
+      F top = dots[0] + u * (dots[1] - dots[0]);
+      F bottom = dots[2] + u * (dots[3] - dots[2]);
+      sum = sum + (top + v * (bottom - top)) * o.amplitude;
+    }
+
+    F value = sum + base;
+    value = (value < 0.0f) ? 0.0f : value;
+    value = (value > 65535.0f) ? 65535.0f : value;
+    I result = __builtin_convertvector(value, I);
+
+    for (uint32_t lane = 0 ; lane < width ; lane++)
+    {
+      heights[y + lane] = result[lane];
+    }
+  }
+
+  return y;
+}
+
+typedef float Float1 __attribute__((vector_size(4)));
+typedef uint32_t Uint1 __attribute__((vector_size(4)));
+typedef int32_t Int1 __attribute__((vector_size(4)));
+
+//! Scalar fallback of the fbm kernels
+__attribute__((optimize("fp-contract=off")))
+inline uint32_t fbm_row_scalar(const Fbm_octave * octaves, const Fbm_row * rows, uint32_t count, uint32_t first, uint32_t end,
+                               float base, uint16_t * heights)
+{
+  return fbm_kernel<Float1, Uint1, Int1>(octaves, rows, count, first, end, base, heights);
+}
+
+#ifdef __x86_64__
+
+typedef float Float4 __attribute__((vector_size(16)));
+typedef uint32_t Uint4 __attribute__((vector_size(16)));
+typedef int32_t Int4 __attribute__((vector_size(16)));
+typedef float Float8 __attribute__((vector_size(32)));
+typedef uint32_t Uint8 __attribute__((vector_size(32)));
+typedef int32_t Int8 __attribute__((vector_size(32)));
+typedef float Float16 __attribute__((vector_size(64)));
+typedef uint32_t Uint16 __attribute__((vector_size(64)));
+typedef int32_t Int16 __attribute__((vector_size(64)));
+
+//! The kernels are compiled for their instruction set whatever the flags of the build, and called only when the processor
+//! supports it. avx512f brings FMA, the contraction is disabled to keep the results of the scalar fallback.
+__attribute__((target("sse4.1"), optimize("fp-contract=off")))
+inline uint32_t fbm_row_sse4_1(const Fbm_octave * octaves, const Fbm_row * rows, uint32_t count, uint32_t first, uint32_t end,
+                               float base, uint16_t * heights)
+{
+  return fbm_kernel<Float4, Uint4, Int4>(octaves, rows, count, first, end, base, heights);
+}
+
+__attribute__((target("avx2"), optimize("fp-contract=off")))
+inline uint32_t fbm_row_avx2(const Fbm_octave * octaves, const Fbm_row * rows, uint32_t count, uint32_t first, uint32_t end,
+                             float base, uint16_t * heights)
+{
+  return fbm_kernel<Float8, Uint8, Int8>(octaves, rows, count, first, end, base, heights);
+}
+
+__attribute__((target("avx512f"), optimize("fp-contract=off")))
+inline uint32_t fbm_row_avx512(const Fbm_octave * octaves, const Fbm_row * rows, uint32_t count, uint32_t first, uint32_t end,
+                               float base, uint16_t * heights)
+{
+  return fbm_kernel<Float16, Uint16, Int16>(octaves, rows, count, first, end, base, heights);
+}
+
+#endif
+
+//! Best SIMD level supported by the processor
+inline Simd_level cpu_simd_level()
+{
+#ifdef __x86_64__
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx512f"))
+  {
+    return Simd_level::avx512;
+  }
+  if (__builtin_cpu_supports("avx2"))
+  {
+    return Simd_level::avx2;
+  }
+  if (__builtin_cpu_supports("sse4.1"))
+  {
+    return Simd_level::sse4_1;
+  }
+#endif
+  return Simd_level::scalar;
+}
+
+//! Heights of fractional brownian motion: a sum of octaves of gradient noise, each one finer and weaker than the previous one.
+//! Each point of the grid of an octave has a pseudo random gradient hashed from its coordinates and the seed, the noise of a
+//! pixel is the smooth interpolation of the gradients of the corners of its cell. Every pixel is independent, so the rows
+//! can be computed in any order on any number of threads, with the widest kernel the processor supports.
+class Fbm_noise
+{
+  public :
+    //! Noise of the seed for a map of size pixels, with the kernels of the level (lowered to what the processor supports)
+    Fbm_noise(uint32_t seed, uint32_t size, Simd_level simd = Simd_level::best) : level(std::min(simd, cpu_simd_level()))
+    {
+      const Config & config = Config::get();
+
+      //The sum of the octaves is about centered on 0, about a third of the map ends up under the ocean
+      base = std::min(65535.0, config.ocean_height + 0.08 * 65535);
+
+      //The amplitudes are scaled so the sum of the octaves spans about the range of the heights
+      double frequency = 1.0 / (std::max(1e-6f, config.fbm_wavelength) * size);
+      double amplitude = 1;
+      double amplitudes = 0;
+
+      //Past 2^24 cells along the map, a float no longer holds the position in the cell
+      uint32_t octave_count = std::min(config.fbm_octaves, uint32_t(max_octaves));
+
+      for (uint32_t octave = 0 ; (octave < octave_count) and (frequency * size < (1 << 24)) ; octave++)
+      {
+        uint64_t hash = random_hash(seed, octave, 0, 0);
+        octaves.push_back(Fbm_octave{float(frequency), float(hash % 256), float(amplitude), uint32_t(hash >> 32)});
+        amplitudes += amplitude;
+        frequency *= config.fbm_lacunarity;
+        amplitude *= config.fbm_persistence;
+      }
+
+      for (Fbm_octave & octave : octaves)
+      {
+        octave.amplitude = octave.amplitude * noise_scale / amplitudes;
+      }
+    }
+
+    //! Heights of the row x of a map of size pixels
+    void row(uint32_t x, uint32_t size, uint16_t * heights) const
+    {
+      Fbm_row rows[max_octaves];
+      fbm_rows(octaves.data(), octaves.size(), x, rows);
+
+      uint32_t y = 0;
+
+#ifdef __x86_64__
+      switch (level)
+      {
+        case Simd_level::avx512 : y = fbm_row_avx512(octaves.data(), rows, octaves.size(), y, size, base, heights); break;
+        case Simd_level::avx2   : y = fbm_row_avx2(octaves.data(), rows, octaves.size(), y, size, base, heights); break;
+        case Simd_level::sse4_1 : y = fbm_row_sse4_1(octaves.data(), rows, octaves.size(), y, size, base, heights); break;
+        default : break;
+      }
+#endif
+
+      fbm_row_scalar(octaves.data(), rows, octaves.size(), y, size, base, heights);
+    }
+
+    //! Kernels used
+    Simd_level simd_level() const
+    {
+      return level;
+    }
+
+  private :
+    //! Height of a unit of the sum of the octaves, a unit of noise being a unit of gradient
+    static constexpr double noise_scale = 900;
+    //! Octaves kept at most, the values of their rows are on the stack
+    static const uint32_t max_octaves = 24;
+
+    std::vector<Fbm_octave> octaves;
+    float base;  //Height of a sum of 0
+    Simd_level level;
+};
+
+//---------------------------------------------------------------//
+//                         Relief shading                        //
+//---------------------------------------------------------------//
+
+//! Parameters of the relief shading, the shade of a map is computed again only when they change
+struct Light
+{
+  Light() : azimuth(Config::get().sun_azimuth), altitude(Config::get().sun_altitude), level(Config::get().light_level),
+            occlusion(Config::get().ambient_occlusion ? Config::get().ambient_occlusion_strength : 0),
+            directions(Config::get().ambient_occlusion_directions), ocean_height(Config::get().ocean_height) { }
+
+  bool operator==(const Light & other) const
+  {
+    return (azimuth == other.azimuth) and (altitude == other.altitude) and (level == other.level)
+       and (occlusion == other.occlusion) and (directions == other.directions) and (ocean_height == other.ocean_height);
+  }
+
+  float azimuth;
+  float altitude;
+  float level;
+  float occlusion;
+  uint8_t directions;
+  uint32_t ocean_height;
+};
+
+//! Shade values stored in a shade buffer: 128 keeps the color, 0 is black and 255 is white
+const uint8_t shade_neutral = 128;
+
+//! Alter a color according to its shade
+inline Color shade_color(Color color, uint8_t shade)
+{
+  if (shade >= shade_neutral)
+  {
+    uint32_t light = shade - shade_neutral;
+    color.red = color.red + light * (255 - color.red) / 127;
+    color.green = color.green + light * (255 - color.green) / 127;
+    color.blue = color.blue + light * (255 - color.blue) / 127;
+  }
+  else
+  {
+    color.red = color.red * shade / shade_neutral;
+    color.green = color.green * shade / shade_neutral;
+    color.blue = color.blue * shade / shade_neutral;
+  }
+  return color;
+}
+
+//! Constants of the hillshading computed once per map
+struct Hillshade
+{
+  Hillshade(const Light & light)
+  {
+    const float radian = 3.14159265f / 180;
+
+    //x goes toward the south and y toward the east, the sun vector points to the sun
+    sun_x = -std::cos(light.azimuth * radian) * std::cos(light.altitude * radian);
+    sun_y = std::sin(light.azimuth * radian) * std::cos(light.altitude * radian);
+    sun_z = std::sin(light.altitude * radian);
+
+    //The gradient is computed with central differences, over two pixels
+    z_scale = light.level / 65535 / 2;
+
+    //A flat pixel keeps its color, a pixel facing the sun is white
+    gain = (sun_z < 1) ? 1 / (1 - sun_z) : 1;
+    occlusion = light.occlusion / 255;
+    ocean_height = light.ocean_height;
+  }
+
+  float sun_x;
+  float sun_y;
+  float sun_z;
+  float z_scale;
+  float gain;
+  float occlusion;
+  float ocean_height;
+};
+
+//! Shade of one pixel from the height differences around it and its occlusion. Used for the pixels the SIMD path does not
+//! cover, it does the same float operations.
+inline uint8_t hillshade_pixel(float delta_x, float delta_y, float height, float occlusion, const Hillshade & hillshade)
+{
+  float gradient_x = delta_x * hillshade.z_scale;
+  float gradient_y = delta_y * hillshade.z_scale;
+  float light = (hillshade.sun_z - gradient_x * hillshade.sun_x - gradient_y * hillshade.sun_y)
+              / std::sqrt(gradient_x * gradient_x + gradient_y * gradient_y + 1.0f);
+  float factor = (light - hillshade.sun_z) * hillshade.gain - occlusion * hillshade.occlusion;
+
+  //Reduce the light under water to obtain a better looking result.
+  if (height < hillshade.ocean_height)
+  {
+    factor = factor / 3;
+  }
+
+  factor = std::min(1.0f, std::max(-1.0f, factor));
+  return shade_neutral + int32_t(factor * 127.0f);
+}
+
+//! Shade of the pixels of a row. above and below are the neighbour rows (the row itself on the map borders), shade holds the
+//! occlusion of each pixel and receives its shade.
+inline void hillshade_row(const uint16_t * above, const uint16_t * row, const uint16_t * below, uint32_t count,
+                          const Hillshade & hillshade, uint8_t * shade)
+{
+  if (count < 2)
+  {
+    return;
+  }
+
+  shade[0] = hillshade_pixel(float(below[0]) - above[0], 2.0f * (float(row[1]) - row[0]), row[0], shade[0], hillshade);
+
+  uint32_t y = 1;
+
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  const __m128 z_scale = _mm_set1_ps(hillshade.z_scale);
+  const __m128 sun_x = _mm_set1_ps(hillshade.sun_x);
+  const __m128 sun_y = _mm_set1_ps(hillshade.sun_y);
+  const __m128 sun_z = _mm_set1_ps(hillshade.sun_z);
+  const __m128 gain = _mm_set1_ps(hillshade.gain);
+  const __m128 occlusion_weight = _mm_set1_ps(hillshade.occlusion);
+  const __m128 ocean_height = _mm_set1_ps(hillshade.ocean_height);
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 third = _mm_set1_ps(3.0f);
+  const __m128 scale = _mm_set1_ps(127.0f);
+  const __m128i neutral = _mm_set1_epi32(shade_neutral);
+
+  for ( ; y + 4 < count ; y += 4)
+  {
+    __m128 north = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)(above + y)), zero));
+    __m128 south = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)(below + y)), zero));
+    __m128 west = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)(row + y - 1)), zero));
+    __m128 east = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)(row + y + 1)), zero));
+    __m128 height = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)(row + y)), zero));
+
+    int32_t occlusions;
+    std::memcpy(&occlusions, shade + y, 4);
+    __m128 occlusion = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(occlusions), zero), zero));
+
+    __m128 gradient_x = _mm_mul_ps(_mm_sub_ps(south, north), z_scale);
+    __m128 gradient_y = _mm_mul_ps(_mm_sub_ps(east, west), z_scale);
+    __m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(gradient_x, gradient_x), _mm_mul_ps(gradient_y, gradient_y)), one));
+    __m128 light = _mm_div_ps(_mm_sub_ps(_mm_sub_ps(sun_z, _mm_mul_ps(gradient_x, sun_x)), _mm_mul_ps(gradient_y, sun_y)), length);
+    __m128 factor = _mm_sub_ps(_mm_mul_ps(_mm_sub_ps(light, sun_z), gain), _mm_mul_ps(occlusion, occlusion_weight));
+
+    __m128 under_water = _mm_cmplt_ps(height, ocean_height);
+    factor = _mm_or_ps(_mm_and_ps(under_water, _mm_div_ps(factor, third)), _mm_andnot_ps(under_water, factor));
+    factor = _mm_min_ps(one, _mm_max_ps(_mm_sub_ps(_mm_setzero_ps(), one), factor));
+
+    __m128i shades = _mm_add_epi32(neutral, _mm_cvttps_epi32(_mm_mul_ps(factor, scale)));
+    shades = _mm_packus_epi16(_mm_packs_epi32(shades, zero), zero);
+    occlusions = _mm_cvtsi128_si32(shades);
+    std::memcpy(shade + y, &occlusions, 4);
+  }
+#endif
+
+  for ( ; y + 1 < count ; y++)
+  {
+    shade[y] = hillshade_pixel(float(below[y]) - above[y], float(row[y + 1]) - row[y - 1], row[y], shade[y], hillshade);
+  }
+
+  y = count - 1;
+  shade[y] = hillshade_pixel(float(below[y]) - above[y], 2.0f * (float(row[y]) - row[y - 1]), row[y], shade[y], hillshade);
+}
+
+//! Upper convex hull of the points already seen along a line. The highest horizon seen from a new point is on this hull,
+//! and the points hidden by the new point are never the horizon of the next ones, so a line is processed in linear time.
+struct Horizon
+{
+  float * position;
+  float * height;
+  uint32_t count;
+
+  //! Add the next point of the line and return the sinus of the elevation of its horizon (0 when nothing is above it)
+  float add(float point_position, float point_height)
+  {
+    while ((count >= 2) and (slope(count - 2, point_position, point_height) >= slope(count - 1, point_position, point_height)))
+    {
+      count--;
+    }
+
+    float horizon = (count > 0) ? std::max(0.0f, slope(count - 1, point_position, point_height)) : 0;
+
+    position[count] = point_position;
+    height[count] = point_height;
+    count++;
+
+    return horizon / std::sqrt(1.0f + horizon * horizon);
+  }
+
+  float slope(uint32_t index, float point_position, float point_height) const
+  {
+    return (height[index] - point_height) / (point_position - position[index]);
+  }
+};
+
+//---------------------------------------------------------------//
+//                        Unbounded world                        //
+//---------------------------------------------------------------//
+
+//! Unbounded map, any area of it can be generated on its own without materialising the rest of the world.
+//! The diamond-square algorithm runs on the infinite lattice: the points of the coarsest level are random, every other point
+//! is computed from its neighbours with an offset keyed on its world coordinates. Computing an area only requires a border
+//! of a few points per level around it, and a given pixel always gets the same height, so adjacent tiles match exactly.
+class World
+{
+  public :
+    //! \param seed Each seed provide an unique world
+    //! \param cell_size Distance in pixel between the random points of the coarsest level, rounded down to a power of two
+    World(uint32_t seed = Config::get().seed, uint32_t cell_size = Config::get().world_cell_size)
+      : seed(seed), cell_size(cell_size)
+    {
+      //If not a power of two, find the nearest power of two by decrementing
+      while(not is_power_of_two(this->cell_size))
+      {
+        this->cell_size--;
+      }
+    }
+
+    //! Heights of the tile (tile_x, tile_y). The tile covers the world pixels [tile_x * size, tile_x * size + size] on both
+    //! axis: it is (size + 1) * (size + 1) pixels, its last row and column are the first ones of the next tiles.
+    std::vector<uint16_t> tile(int64_t tile_x, int64_t tile_y, uint32_t size) const
+    {
+      return area(tile_x * size, tile_y * size, size + 1, size + 1);
+    }
+
+    //! Heights of the world pixels [x, x + rows) * [y, y + columns), stored row by row (x is the row, like in Map)
+    std::vector<uint16_t> area(int64_t x, int64_t y, uint32_t rows, uint32_t columns) const
+    {
+      int64_t last_x = x + rows - 1;
+      int64_t last_y = y + columns - 1;
+
+      //Random points of the coarsest level, covering the area and its border
+      Lattice coarse = lattice(x, y, last_x, last_y, cell_size);
+
+      Thread_pool::get().parallel_for(0, coarse.rows, [this, &coarse] (uint64_t begin, uint64_t end)
+      {
+        for (uint64_t row = begin ; row < end ; row++)
+        {
+          for (uint64_t column = 0 ; column < coarse.columns ; column++)
+          {
+            coarse.at(row, column) = random_hash(seed, 0, coarse.world_x(row), coarse.world_y(column));
+          }
+        }
+      });
+
+      //Each level double the resolution of the lattice and shrink the border around the area
+      for (uint32_t spacing = cell_size ; spacing > 1 ; spacing = spacing / 2)
+      {
+        coarse = refine(coarse, x, y, last_x, last_y);
+      }
+
+      return coarse.values;
+    }
+
+  private :
+    //! Points of a level of the diamond-square algorithm over a rectangular part of the world
+    struct Lattice
+    {
+      int64_t x;         //Lattice coordinates of the first point, the world coordinates are x * spacing
+      int64_t y;
+      uint64_t rows;
+      uint64_t columns;
+      uint32_t spacing;
+      std::vector<uint16_t> values;
+
+      uint16_t & at(uint64_t row, uint64_t column)
+      {
+        return values[columns * row + column];
+      }
+
+      int64_t world_x(uint64_t row) const
+      {
+        return (x + int64_t(row)) * spacing;
+      }
+
+      int64_t world_y(uint64_t column) const
+      {
+        return (y + int64_t(column)) * spacing;
+      }
+    };
+
+    //! Division rounded toward minus infinity
+    static int64_t floor_div(int64_t value, int64_t divisor)
+    {
+      return (value >= 0) ? value / divisor : -((-value + divisor - 1) / divisor);
+    }
+
+    //! Lattice of the given spacing covering [first_x, last_x] * [first_y, last_y] and the border needed by the finer levels.
+    //! A point depends on points of the previous level at most one spacing away, so the border of a level is twice its
+    //! spacing (the sum of the borders of all the finer levels). The finest level has no border.
+    static Lattice lattice(int64_t first_x, int64_t first_y, int64_t last_x, int64_t last_y, uint32_t spacing)
+    {
+      int64_t border = (spacing == 1) ? 0 : 2 * spacing;
+
+      Lattice result;
+      result.spacing = spacing;
+      result.x = floor_div(first_x - border, spacing);
+      result.y = floor_div(first_y - border, spacing);
+      result.rows = floor_div(last_x + border + spacing - 1, spacing) - result.x + 1;
+      result.columns = floor_div(last_y + border + spacing - 1, spacing) - result.y + 1;
+      result.values.resize(result.rows * result.columns);
+      return result;
+    }
+
+    //! Compute the next level of the diamond-square algorithm: the square centers and diamonds between the coarse points.
+    //! Only the part of the finer lattice needed by [first_x, last_x] * [first_y, last_y] is kept.
+    Lattice refine(Lattice & coarse, int64_t first_x, int64_t first_y, int64_t last_x, int64_t last_y) const
+    {
+      uint32_t spacing = coarse.spacing / 2;
+      uint32_t square_size = coarse.spacing + 1;
+
+      //Every point between the coarse points, the outermost diamonds miss a neighbour and are not computed
+      Lattice fine;
+      fine.spacing = spacing;
+      fine.x = 2 * coarse.x;
+      fine.y = 2 * coarse.y;
+      fine.rows = 2 * coarse.rows - 1;
+      fine.columns = 2 * coarse.columns - 1;
+      fine.values.resize(fine.rows * fine.columns);
+
+      //Square step, the coarse points are copied on the even rows
+      Thread_pool::get().parallel_for(0, coarse.rows, [&] (uint64_t begin, uint64_t end)
+      {
+        for (uint64_t row = begin ; row < end ; row++)
+        {
+          for (uint64_t column = 0 ; column < coarse.columns ; column++)
+          {
+            fine.at(2 * row, 2 * column) = coarse.at(row, column);
+
+            if ((row + 1 < coarse.rows) and (column + 1 < coarse.columns))
+            {
+              uint32_t mean = ( coarse.at(row, column) + coarse.at(row, column + 1)
+                              + coarse.at(row + 1, column) + coarse.at(row + 1, column + 1)) / 4;
+
+              fine.at(2 * row + 1, 2 * column + 1) = mean + offset(square_size, fine.world_x(2 * row + 1), fine.world_y(2 * column + 1));
+            }
+          }
+        }
+      });
+
+      //Diamond step
+      Thread_pool::get().parallel_for(1, fine.rows - 1, [&] (uint64_t begin, uint64_t end)
+      {
+        for (uint64_t row = begin ; row < end ; row++)
+        {
+          for (uint64_t column = 1 + row % 2 ; column + 1 < fine.columns ; column = column + 2)
+          {
+            uint32_t mean = ( fine.at(row - 1, column) + fine.at(row, column + 1)
+                            + fine.at(row + 1, column) + fine.at(row, column - 1)) / 4;
+
+            fine.at(row, column) = mean + offset(square_size, fine.world_x(row), fine.world_y(column));
+          }
+        }
+      });
+
+      //Keep only the points needed by the next levels
+      Lattice result = lattice(first_x, first_y, last_x, last_y, spacing);
+      uint64_t row_offset = result.x - fine.x;
+      uint64_t column_offset = result.y - fine.y;
+
+      for (uint64_t row = 0 ; row < result.rows ; row++)
+      {
+        std::copy(&fine.at(row + row_offset, column_offset), &fine.at(row + row_offset, column_offset) + result.columns, &result.at(row, 0));
+      }
+
+      return result;
+    }
+
+    //! Random offset of a point, same distribution as the one of Map
+    uint16_t offset(uint32_t square_size, int64_t x, int64_t y) const
+    {
+      int32_t amplitude = Config::get().roughness * square_size;
+
+      return random_range(random_hash(seed, square_size, x, y), -amplitude, amplitude);
+    }
+
+    uint32_t seed;
+    uint32_t cell_size;
+};
+
+//---------------------------------------------------------------//
+//                           Map layers                          //
+//---------------------------------------------------------------//
+
+//! Memory of the layers kept in RAM. The regions are mapped aligned on huge pages and the system is asked to back them with
+//! transparent huge pages, so the passes over a large map fault and miss the TLB far less than with 4 KB pages. The regions
+//! released are kept for the next layers, a process generating several maps does not map and fault its memory again for
+//! each of them. This class is a singleton.
+class Arena
+{
+  public :
+    //! Memory of a layer or of a map
+    struct Region
+    {
+      uint8_t * data;
+      uint64_t length;
+    };
+
+    inline static Arena & get()
+    {
+      static Arena singleton;
+      return singleton;
+    }
+
+    //! Region of at least bytes. A recycled region is not zeroed, a new one is zeroed by the system on first touch.
+    Region acquire(uint64_t bytes)
+    {
+      //The small regions are not worth a huge page
+      uint64_t page = (bytes >= huge_page) ? huge_page : sysconf(_SC_PAGESIZE);
+      bytes = (bytes + page - 1) / page * page;
+
+      {
+        //The smallest free region large enough, if it does not waste more than the region asked
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<Region>::iterator best = free_regions.end();
+
+        for (std::vector<Region>::iterator region = free_regions.begin() ; region != free_regions.end() ; ++region)
+        {
+          if ((region->length >= bytes) and (region->length <= 2 * bytes)
+           and ((best == free_regions.end()) or (region->length < best->length)))
+          {
+            best = region;
+          }
+        }
+
+        if (best != free_regions.end())
+        {
+          Region region = *best;
+          free_regions.erase(best);
+          return region;
+        }
+      }
+
+      if (page < huge_page)
+      {
+        void * memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        check(memory, bytes);
+        return Region{(uint8_t *)memory, bytes};
+      }
+
+      //Map a huge page more, then unmap what is before and after the aligned region
+      uint8_t * memory = (uint8_t *)mmap(nullptr, bytes + huge_page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      check(memory, bytes);
+
+      uint8_t * aligned = (uint8_t *)((uintptr_t(memory) + huge_page - 1) / huge_page * huge_page);
+      if (aligned > memory)
+      {
+        munmap(memory, aligned - memory);
+      }
+      munmap(aligned + bytes, memory + huge_page - aligned);
+
+#ifdef MADV_HUGEPAGE
+      madvise(aligned, bytes, MADV_HUGEPAGE);
+#endif
+
+      return Region{aligned, bytes};
+    }
+
+    //! Keep a region for the next layers, the oldest region is unmapped when too many are kept
+    void release(Region region)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      free_regions.push_back(region);
+
+      if (free_regions.size() > free_max)
+      {
+        munmap(free_regions.front().data, free_regions.front().length);
+        free_regions.erase(free_regions.begin());
+      }
+    }
+
+    //! Give the regions kept back to the system
+    void trim()
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+
+      for (const Region & region : free_regions)
+      {
+        munmap(region.data, region.length);
+      }
+      free_regions.clear();
+    }
+
+  private :
+    //! Size of the huge pages of x86 and of most ARM systems
+    static const uint64_t huge_page = 2 << 20;
+    //! Regions kept, enough for the layers of a few maps and their stages
+    static const uint32_t free_max = 32;
+
+    Arena() { }
+
+    ~Arena()
+    {
+      trim();
+    }
+
+    Arena(const Arena &rhs);
+    Arena &operator=(const Arena &rhs);
+
+    //! Exit if mmap failed
+    static void check(void * memory, uint64_t bytes)
+    {
+      if (memory == MAP_FAILED)
+      {
+        printf("Error : Cannot allocate %llu bytes\n", (unsigned long long)bytes);
+        exit(1);
+      }
+    }
+
+    std::mutex mutex;
+    std::vector<Region> free_regions;
+};
+
+//! Layout of the values of a layer: the rows stored one after another. The passes walking the rows, and the rows of the
+//! images, read contiguous values.
+struct Row_major
+{
+  //! Values stored for a map of size * size pixels
+  static uint64_t length(uint32_t size)
+  {
+    return uint64_t(size) * size;
+  }
+
+  static uint64_t index(uint32_t size, uint32_t x, uint32_t y)
+  {
+    return uint64_t(size) * x + y;
+  }
+
+  //! Values [begin, end) storing the rows [first, first + count)
+  static std::pair<uint64_t, uint64_t> rows(uint32_t size, uint32_t first, uint32_t count)
+  {
+    return std::make_pair(uint64_t(size) * first, uint64_t(size) * (first + count));
+  }
+};
+
+//! Layout of the values of a layer: square tiles of tile_size * tile_size pixels stored one after another, in row order.
+//! A tile is 8 KB of 16 bits values, the pixels close on the map are close in memory in both directions.
+struct Tiled
+{
+  static const uint32_t tile_shift = 6;
+  static const uint32_t tile_size = 1 << tile_shift;
+
+  static uint32_t tiles(uint32_t size)
+  {
+    return (size + tile_size - 1) >> tile_shift;
+  }
+
+  static uint64_t length(uint32_t size)
+  {
+    return uint64_t(tiles(size)) * tiles(size) * tile_size * tile_size;
+  }
+
+  static uint64_t index(uint32_t size, uint32_t x, uint32_t y)
+  {
+    uint64_t tile = uint64_t(x >> tile_shift) * tiles(size) + (y >> tile_shift);
+    return (tile << (2 * tile_shift)) | ((x & (tile_size - 1)) << tile_shift) | (y & (tile_size - 1));
+  }
+
+  static std::pair<uint64_t, uint64_t> rows(uint32_t size, uint32_t first, uint32_t count)
+  {
+    uint64_t band = uint64_t(tiles(size)) * tile_size * tile_size;
+    return std::make_pair((first >> tile_shift) * band, std::min(length(size), ((first + count + tile_size - 1) >> tile_shift) * band));
+  }
+};
+
+//! Layout of the values of a layer: tiles as in Tiled, the pixels of a tile along a Z-order (Morton) curve, the bits of x
+//! and y interleaved. Each block of 2^k * 2^k pixels of a tile is contiguous. A whole map on the curve would need 3 times its
+//! size, as the sizes are a power of two + 1.
+struct Morton
+{
+  static uint64_t length(uint32_t size)
+  {
+    return Tiled::length(size);
+  }
+
+  static uint64_t index(uint32_t size, uint32_t x, uint32_t y)
+  {
+    uint64_t tile = uint64_t(x >> Tiled::tile_shift) * Tiled::tiles(size) + (y >> Tiled::tile_shift);
+    return (tile << (2 * Tiled::tile_shift)) | (spread(x & (Tiled::tile_size - 1)) << 1) | spread(y & (Tiled::tile_size - 1));
+  }
+
+  static std::pair<uint64_t, uint64_t> rows(uint32_t size, uint32_t first, uint32_t count)
+  {
+    return Tiled::rows(size, first, count);
+  }
+
+  //! Put a 0 between the bits of a value of 8 bits
+  static uint32_t spread(uint32_t value)
+  {
+    value = (value | (value << 4)) & 0x0F0F;
+    value = (value | (value << 2)) & 0x3333;
+    return (value | (value << 1)) & 0x5555;
+  }
+};
+
+//! One value per pixel of a square map, indexed with 64 bits. The values are stored according to the Layout (Row_major,
+//! Tiled or Morton), operator() finds the value of a pixel in any layout. The index of operator[] and data() is the index in
+//! the storage, the same as the pixel index in the row major layout used by the map.
+//! The values are aligned for SIMD. A layer lives in memory, or in a temporary file mapped in memory when the map does not
+//! fit in Config::memory_budget: the system then only keeps in RAM the rows the passes are working on and writes the others
+//! back to the file.
+template <typename T, typename Layout = Row_major>
+class Layer
+{
+  public :
+    Layer() { }
+
+    ~Layer()
+    {
+      release();
+    }
+
+    //! Allocate size * size values set to zero, in a file if file_backed is true
+    void allocate(uint32_t size, bool file_backed)
+    {
+      release();
+
+      length = Layout::length(size);
+      row_length = size;
+
+      if (not file_backed)
+      {
+        region = Arena::get().acquire(bytes(size));
+        values = (T *)region.data;
+        zero();
+        return;
+      }
+
+      //The file is removed as soon as it is created, the space is freed when the layer is released or the process dies
+      std::string name = Config::get().storage_directory + "/map_layer_XXXXXX";
+      std::vector<char> path(name.begin(), name.end());
+      path.push_back('\0');
+
+      descriptor = mkstemp(path.data());
+
+      if ((descriptor < 0) or (unlink(path.data()) != 0) or (ftruncate(descriptor, length * sizeof(T)) != 0))
+      {
+        printf("Error : Cannot create a layer file in %s\n", Config::get().storage_directory.c_str());
+        exit(1);
+      }
+
+      void * memory = mmap(nullptr, length * sizeof(T), PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+
+      if (memory == MAP_FAILED)
+      {
+        printf("Error : Cannot map a layer file in memory\n");
+        exit(1);
+      }
+
+      //The passes walk the rows in order
+      madvise(memory, length * sizeof(T), MADV_SEQUENTIAL);
+      values = (T *)memory;
+    }
+
+    //! Use size * size values of a region owned by the caller, for example a part of the region of a map. The values are
+    //! not zeroed.
+    void attach(uint8_t * memory, uint32_t size)
+    {
+      release();
+
+      length = Layout::length(size);
+      row_length = size;
+      values = (T *)memory;
+      attached = true;
+    }
+
+    //! Bytes used by size * size values, rounded to keep the next layer of a region aligned
+    static uint64_t bytes(uint32_t size)
+    {
+      return (Layout::length(size) * sizeof(T) + alignment - 1) / alignment * alignment;
+    }
+
+    //! Set every value to zero. The storage is split across the threads of the pool like the rows of the passes, so on a
+    //! NUMA system the pages are first touched, and placed, by the threads that usually work on them.
+    void zero()
+    {
+      Thread_pool::get().parallel_for(0, length, [this] (uint64_t begin, uint64_t end)
+      {
+        memset(values + begin, 0, (end - begin) * sizeof(T));
+      });
+    }
+
+    T & operator[](uint64_t index)
+    {
+      return values[index];
+    }
+
+    const T & operator[](uint64_t index) const
+    {
+      return values[index];
+    }
+
+    T & operator()(uint32_t x, uint32_t y)
+    {
+      return values[Layout::index(row_length, x, y)];
+    }
+
+    const T & operator()(uint32_t x, uint32_t y) const
+    {
+      return values[Layout::index(row_length, x, y)];
+    }
+
+    T * data() const
+    {
+      return values;
+    }
+
+    //! Set every value of the layer
+    void fill(T value)
+    {
+      std::fill(values, values + length, value);
+    }
+
+    //! Start writing the rows [first, first + count) of a file backed layer to its file, so their memory can be reclaimed
+    //! without waiting once a pass is done with them. Nothing to do for a layer in memory.
+    void flush(uint32_t first, uint32_t count)
+    {
+      if (descriptor < 0)
+      {
+        return;
+      }
+
+      //msync works on whole pages
+      std::pair<uint64_t, uint64_t> rows = Layout::rows(row_length, first, count);
+      uint64_t page = sysconf(_SC_PAGESIZE);
+      uint64_t begin = rows.first * sizeof(T) / page * page;
+      uint64_t end = std::min(rows.second, length) * sizeof(T);
+
+      if (end > begin)
+      {
+        msync((uint8_t *)values + begin, end - begin, MS_ASYNC);
+      }
+    }
+
+  private :
+    Layer(const Layer &rhs);
+    Layer &operator=(const Layer &rhs);
+
+    void release()
+    {
+      if (descriptor >= 0)
+      {
+        munmap(values, length * sizeof(T));
+        close(descriptor);
+        descriptor = -1;
+      }
+      else if ((values != nullptr) and not attached)
+      {
+        Arena::get().release(region);
+      }
+      values = nullptr;
+      attached = false;
+    }
+
+    //! Alignment of the values in memory, a cache line
+    static const uint32_t alignment = 64;
+
+    T * values = nullptr;
+    Arena::Region region = {nullptr, 0};  //Memory of the values allocated in RAM
+    bool attached = false;  //The values are in a region owned by someone else
+    uint64_t length = 0;
+    uint32_t row_length = 0;
+    int descriptor = -1;
+};
+
+//---------------------------------------------------------------//
+//                           Hydrology                           //
+//---------------------------------------------------------------//
+
+//! Drainage network of a height map: where the water of each pixel flows (D8) and how many pixels drain through it.
+//! Each pixel flows toward its steepest lower neighbor. The pixels without any lower neighbor are the pits of depressions:
+//! the depressions are filled by a priority-flood seeded from the sea and the border of the map. The flood runs on the graph
+//! of the basins draining to each pit, whose edges are the lowest passes between two basins, since the pixels outside of the
+//! depressions already know where to flow. The pass heights are 16 bits, so the priority queue is an array of 65536 buckets
+//! and the flood is linear in the size of the graph. The water of a filled depression leaves it through its lowest pass.
+class Drainage
+{
+  public :
+    //! Direction of the pixels in the sea and on the border of the map, their water leaves the land
+    static const uint8_t outlet = 8;
+
+    Drainage(const Layer<uint16_t> & height, uint32_t size, uint16_t ocean_height, bool file_backed) : size(size)
+    {
+      directions.allocate(size, file_backed);
+      accumulations.allocate(size, file_backed);
+
+      descend(height, ocean_height);
+      uint32_t basins = label();
+      route(height, basins);
+      accumulate();
+    }
+
+    //! Direction of the water leaving a pixel, an index in neighbor_x and neighbor_y, or outlet
+    uint8_t direction(uint64_t pixel) const
+    {
+      return directions[pixel];
+    }
+
+    //! Pixel receiving the water of a pixel that is not an outlet
+    uint64_t receiver(uint64_t pixel) const
+    {
+      return pixel + neighbor_offset(directions[pixel]);
+    }
+
+    //! Number of pixels draining through a pixel, including itself
+    uint32_t accumulation(uint64_t pixel) const
+    {
+      return accumulations[pixel];
+    }
+
+  private :
+    //! Direction of the pixels without lower neighbor, until their depression is filled
+    static const uint8_t pit = 9;
+
+    //! Basin of the sea and the border of the map
+    static const uint32_t sea = 0;
+    //! Basin not yet known
+    static const uint32_t unknown = UINT32_MAX;
+
+    //! Offset of the 8 neighbors, the 4 first ones are the orthogonal ones
+    static const int8_t neighbor_x[8];
+    static const int8_t neighbor_y[8];
+
+    //! Pass between two basins: the pixels on each side of it, and the height to reach to flow from one to the other
+    struct Pass
+    {
+      //! The two basins, the smallest index in the high bits
+      uint64_t basins;
+      uint64_t from;
+      uint64_t to;
+      uint16_t height;
+
+      bool operator<(const Pass & other) const
+      {
+        return (basins < other.basins) or ((basins == other.basins) and (height < other.height));
+      }
+    };
+
+    //! Number of passes cached by each thread while looking for the lowest passes
+    static const uint32_t pass_cache_size = 16381;
+
+    int64_t neighbor_offset(uint8_t direction) const
+    {
+      return int64_t(size) * neighbor_x[direction] + neighbor_y[direction];
+    }
+
+    //! Direction going from a pixel to one of its neighbors
+    uint8_t direction_to(uint64_t pixel, uint64_t neighbor) const
+    {
+      for (uint8_t direction = 0 ; direction < 8 ; direction++)
+      {
+        if (pixel + neighbor_offset(direction) == neighbor)
+        {
+          return direction;
+        }
+      }
+      return outlet;
+    }
+
+    //! Steepest descent direction of each pixel, the pixels are independent so the rows are split across the threads
+    void descend(const Layer<uint16_t> & height, uint16_t ocean_height)
+    {
+      Thread_pool::get().parallel_for(0, size, [this, &height, ocean_height] (uint64_t begin, uint64_t end)
+      {
+        const float inverse_distance[8] = {1, 1, 1, 1, 0.70710678f, 0.70710678f, 0.70710678f, 0.70710678f};
+
+        for (uint32_t x = begin ; x < end ; x++)
+        {
+          for (uint32_t y = 0 ; y < size ; y++)
+          {
+            uint64_t pixel = uint64_t(size) * x + y;
+            int32_t current = height[pixel];
+
+            if ((current < ocean_height) or (x == 0) or (y == 0) or (x == size - 1) or (y == size - 1))
+            {
+              directions[pixel] = outlet;
+              continue;
+            }
+
+            uint8_t steepest = pit;
+            float steepest_slope = 0;
+
+            for (uint8_t direction = 0 ; direction < 8 ; direction++)
+            {
+              float slope = (current - height[pixel + neighbor_offset(direction)]) * inverse_distance[direction];
+
+              if (slope > steepest_slope)
+              {
+                steepest = direction;
+                steepest_slope = slope;
+              }
+            }
+
+            directions[pixel] = steepest;
+          }
+        }
+      });
+    }
+
+    //! Store in accumulations the basin of each pixel: the sea for the pixels flowing out of the land, or the pit they flow to.
+    //! Each chain of pixels is followed until a pixel of known basin, then labelled, so every pixel is visited once.
+    //! \return Number of basins, including the sea
+    uint32_t label()
+    {
+      Layer<uint32_t> & basins = accumulations;
+      uint32_t count = sea + 1;
+
+      for (uint64_t pixel = 0 ; pixel < uint64_t(size) * size ; pixel++)
+      {
+        switch (directions[pixel])
+        {
+          case outlet : basins[pixel] = sea; break;
+          case pit : basins[pixel] = count++; break;
+          default : basins[pixel] = unknown; break;
+        }
+      }
+
+      std::vector<uint64_t> path;
+
+      for (uint64_t pixel = 0 ; pixel < uint64_t(size) * size ; pixel++)
+      {
+        uint64_t current = pixel;
+        while (basins[current] == unknown)
+        {
+          path.push_back(current);
+          current = receiver(current);
+        }
+
+        for (uint64_t chain : path)
+        {
+          basins[chain] = basins[current];
+        }
+        path.clear();
+      }
+
+      return count;
+    }
+
+    //! Fill the depressions: find the lowest passes between adjacent basins, flood the basins from the sea by increasing
+    //! pass height, then make each pit flow out of its basin through the pass its basin was flooded from.
+    void route(const Layer<uint16_t> & height, uint32_t basin_count)
+    {
+      const Layer<uint32_t> & basins = accumulations;
+
+      //Lowest pass between each pair of adjacent basins, found on the pixels of the basins borders
+      std::vector<Pass> passes;
+      std::mutex mutex;
+
+      Thread_pool::get().parallel_for(0, size - 1, [this, &height, &basins, &passes, &mutex] (uint64_t begin, uint64_t end)
+      {
+        //Right, bottom left, bottom and bottom right neighbors: each pair of neighbors is seen once
+        const uint8_t forward[4] = {3, 7, 1, 5};
+        std::vector<Pass> local;
+
+        //The border between two basins spans several rows, the lowest pass found on the last rows is kept in a small
+        //direct-mapped cache and only the evicted passes are stored
+        std::vector<Pass> cache(pass_cache_size, Pass{UINT64_MAX, 0, 0, 0});
+
+        for (uint32_t x = begin ; x < end ; x++)
+        {
+          for (uint32_t y = 0 ; y < size ; y++)
+          {
+            uint64_t pixel = uint64_t(size) * x + y;
+
+            for (uint8_t direction : forward)
+            {
+              if (((y == 0) and (neighbor_y[direction] < 0)) or ((y == size - 1) and (neighbor_y[direction] > 0)))
+              {
+                continue;
+              }
+
+              uint64_t neighbor = pixel + neighbor_offset(direction);
+              uint32_t basin = basins[pixel];
+              uint32_t other = basins[neighbor];
+
+              if (basin == other)
+              {
+                continue;
+              }
+
+              Pass pass = {(uint64_t(std::min(basin, other)) << 32) | std::max(basin, other), pixel, neighbor,
+                           std::max(height[pixel], height[neighbor])};
+              Pass & cached = cache[hash_mix(pass.basins) % pass_cache_size];
+
+              if (cached.basins != pass.basins)
+              {
+                if (cached.basins != UINT64_MAX)
+                {
+                  local.push_back(cached);
+                }
+                cached = pass;
+              }
+              else if (pass.height < cached.height)
+              {
+                cached = pass;
+              }
+            }
+          }
+        }
+
+        for (const Pass & cached : cache)
+        {
+          if (cached.basins != UINT64_MAX)
+          {
+            local.push_back(cached);
+          }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        passes.insert(passes.end(), local.begin(), local.end());
+      });
+
+      //Keep the lowest pass of each pair of basins
+      std::sort(passes.begin(), passes.end());
+      passes.erase(std::unique(passes.begin(), passes.end(), [] (const Pass & first, const Pass & second)
+      {
+        return first.basins == second.basins;
+      }), passes.end());
+
+      //Graph of the basins, the edges of each basin are stored contiguously after the ones of the previous basins
+      std::vector<uint64_t> first_edge(basin_count + 1, 0);
+      for (const Pass & pass : passes)
+      {
+        first_edge[(pass.basins >> 32) + 1]++;
+        first_edge[(pass.basins & UINT32_MAX) + 1]++;
+      }
+      for (uint32_t basin = 0 ; basin < basin_count ; basin++)
+      {
+        first_edge[basin + 1] += first_edge[basin];
+      }
+
+      //Basin at the other end of each edge, and the pass of the edge
+      std::vector<std::pair<uint32_t, uint32_t>> graph(first_edge[basin_count]);
+      {
+        std::vector<uint64_t> next_edge(first_edge.begin(), first_edge.end() - 1);
+        for (uint32_t edge = 0 ; edge < passes.size() ; edge++)
+        {
+          uint32_t low = passes[edge].basins >> 32;
+          uint32_t high = passes[edge].basins & UINT32_MAX;
+          graph[next_edge[low]++] = std::make_pair(high, edge);
+          graph[next_edge[high]++] = std::make_pair(low, edge);
+        }
+      }
+
+      //Priority-flood of the basins from the sea. A basin is flooded by the edge that reaches it at the lowest level, the
+      //buckets may hold a basin several times and only its first appearance counts.
+      std::vector<uint32_t> flooded_by(basin_count, UINT32_MAX);
+      std::vector<bool> flooded(basin_count, false);
+      std::vector<std::vector<std::pair<uint32_t, uint32_t>>> buckets(65536);
+
+      buckets[0].push_back(std::make_pair(sea, UINT32_MAX));
+
+      for (uint32_t level = 0 ; level < 65536 ; level++)
+      {
+        std::vector<std::pair<uint32_t, uint32_t>> & bucket = buckets[level];
+
+        //The bucket grows while the basins at this level are processed
+        for (uint64_t i = 0 ; i < bucket.size() ; i++)
+        {
+          uint32_t basin = bucket[i].first;
+          if (flooded[basin])
+          {
+            continue;
+          }
+
+          flooded[basin] = true;
+          flooded_by[basin] = bucket[i].second;
+
+          for (uint64_t edge = first_edge[basin] ; edge < first_edge[basin + 1] ; edge++)
+          {
+            uint32_t other = graph[edge].first;
+
+            if (not flooded[other])
+            {
+              uint32_t pass = graph[edge].second;
+              buckets[std::max<uint32_t>(passes[pass].height, level)].push_back(std::make_pair(other, pass));
+            }
+          }
+        }
+
+        std::vector<std::pair<uint32_t, uint32_t>>().swap(bucket);
+      }
+
+      //Reverse the flow from each pass to the pit of its basin, then leave the basin through the pass
+      for (uint32_t basin = sea + 1 ; basin < basin_count ; basin++)
+      {
+        if (flooded_by[basin] == UINT32_MAX)
+        {
+          continue;
+        }
+
+        const Pass & pass = passes[flooded_by[basin]];
+        bool forward = (basins[pass.from] == basin);
+        uint64_t previous = forward ? pass.to : pass.from;
+        uint64_t current = forward ? pass.from : pass.to;
+
+        while (true)
+        {
+          bool at_pit = (directions[current] == pit);
+          uint64_t next = at_pit ? current : receiver(current);
+
+          directions[current] = direction_to(current, previous);
+
+          if (at_pit)
+          {
+            break;
+          }
+          previous = current;
+          current = next;
+        }
+      }
+    }
+
+    //! Count the pixels draining through each pixel. A pixel is final once all its donors are, so each chain of pixels is
+    //! followed downstream until it reaches a pixel still waiting for a donor: every pixel is visited once.
+    void accumulate()
+    {
+      //Number of donors not yet accumulated of each pixel
+      Layer<uint8_t> donors;
+      donors.allocate(size, false);
+
+      for (uint64_t pixel = 0 ; pixel < uint64_t(size) * size ; pixel++)
+      {
+        accumulations[pixel] = 1;
+
+        if (directions[pixel] != outlet)
+        {
+          donors[receiver(pixel)]++;
+        }
+      }
+
+      for (uint64_t pixel = 0 ; pixel < uint64_t(size) * size ; pixel++)
+      {
+        if (donors[pixel] != 0)
+        {
+          continue;
+        }
+
+        //Mark the start of the chain as done, then push the water downstream
+        uint64_t current = pixel;
+        donors[current] = done;
+
+        while (directions[current] != outlet)
+        {
+          uint64_t next = receiver(current);
+          uint32_t sum = accumulations[next] + accumulations[current];
+          accumulations[next] = (sum < accumulations[next]) ? UINT32_MAX : sum;
+
+          if (--donors[next] != 0)
+          {
+            break;
+          }
+          donors[next] = done;
+          current = next;
+        }
+      }
+    }
+
+    //! Donors count of the pixels already accumulated
+    static const uint8_t done = 255;
+
+    uint32_t size;
+    Layer<uint8_t> directions;
+    Layer<uint32_t> accumulations;
+};
+
+const uint32_t Drainage::sea;
+//The opposite of a direction is direction ^ 1
+const int8_t Drainage::neighbor_x[8] = {-1, 1, 0, 0, -1, 1, -1, 1};
+const int8_t Drainage::neighbor_y[8] = {0, 0, -1, 1, -1, 1, 1, -1};
+
+//---------------------------------------------------------------//
+//                             Cities                            //
+//---------------------------------------------------------------//
+
+//! A city of the map
+struct City
+{
+  uint32_t x;
+  uint32_t y;
+  //! Suitability of the site, the higher the better
+  float score;
+};
+
+//! Cities indexed by a uniform grid. The cells are hashed in a table of buckets, so the memory used depends on the number of
+//! cities and not on the size of the map. The cells are as large as the distance the searches usually look at.
+class City_index
+{
+  public :
+    City_index(float cell_size = 1) : cell_size(cell_size), buckets(1)
+    {
+    }
+
+    //! \return Identifier of the city, its index in the order of insertion
+    uint32_t add(const City & city)
+    {
+      cities.push_back(city);
+      max_cell = std::max(max_cell, std::max(cell(city.x), cell(city.y)));
+
+      //Keep about one city per bucket
+      if (cities.size() > buckets.size())
+      {
+        rehash(2 * buckets.size());
+      }
+      else
+      {
+        buckets[bucket(cell(city.x), cell(city.y))].push_back(cities.size() - 1);
+      }
+
+      return cities.size() - 1;
+    }
+
+    uint32_t size() const
+    {
+      return cities.size();
+    }
+
+    const City & operator[](uint32_t city) const
+    {
+      return cities[city];
+    }
+
+    //! Identifiers of the cities closer than radius to (x, y)
+    std::vector<uint32_t> within(float x, float y, float radius) const
+    {
+      std::vector<uint32_t> found;
+
+      visit(x - radius, y - radius, x + radius, y + radius, [this, &found, x, y, radius] (uint32_t city)
+      {
+        if (distance2(cities[city], x, y) <= radius * radius)
+        {
+          found.push_back(city);
+        }
+      });
+
+      return found;
+    }
+
+    //! Identifier of the city closest to (x, y), -1 if the index is empty.
+    //! The rings of cells around (x, y) are searched until the cities not searched yet are further than the closest one.
+    int64_t nearest(float x, float y) const
+    {
+      int64_t nearest = -1;
+      float nearest_distance2 = HUGE_VALF;
+
+      for (int64_t ring = 0 ; ring <= int64_t(max_cell) + 1 ; ring++)
+      {
+        float low_x = x - ring * cell_size;
+        float low_y = y - ring * cell_size;
+        float high_x = x + ring * cell_size;
+        float high_y = y + ring * cell_size;
+
+        visit(low_x, low_y, high_x, high_y, [this, &nearest, &nearest_distance2, x, y] (uint32_t city)
+        {
+          float distance = distance2(cities[city], x, y);
+          if (distance < nearest_distance2)
+          {
+            nearest = city;
+            nearest_distance2 = distance;
+          }
+        });
+
+        //Every city at less than ring * cell_size has been seen
+        if (nearest_distance2 <= float(ring * cell_size) * (ring * cell_size))
+        {
+          break;
+        }
+      }
+
+      return nearest;
+    }
+
+  private :
+    static float distance2(const City & city, float x, float y)
+    {
+      return (city.x - x) * (city.x - x) + (city.y - y) * (city.y - y);
+    }
+
+    uint32_t cell(float position) const
+    {
+      return std::max(0.0f, position) / cell_size;
+    }
+
+    uint64_t bucket(uint32_t cell_x, uint32_t cell_y) const
+    {
+      return hash_mix((uint64_t(cell_x) << 32) | cell_y) & (buckets.size() - 1);
+    }
+
+    //! Call function(city) once for each city of the cells overlapping the rectangle [low_x, high_x] x [low_y, high_y].
+    //! The cities of the other cells sharing a bucket are skipped.
+    template <typename Function>
+    void visit(float low_x, float low_y, float high_x, float high_y, Function function) const
+    {
+      if ((high_x < 0) or (high_y < 0))
+      {
+        return;
+      }
+
+      uint32_t last_x = std::min(cell(high_x), max_cell);
+      uint32_t last_y = std::min(cell(high_y), max_cell);
+
+      for (uint32_t cell_x = cell(low_x) ; cell_x <= last_x ; cell_x++)
+      {
+        for (uint32_t cell_y = cell(low_y) ; cell_y <= last_y ; cell_y++)
+        {
+          for (uint32_t city : buckets[bucket(cell_x, cell_y)])
+          {
+            if ((cell(cities[city].x) == cell_x) and (cell(cities[city].y) == cell_y))
+            {
+              function(city);
+            }
+          }
+        }
+      }
+    }
+
+    void rehash(uint64_t bucket_count)
+    {
+      buckets.assign(bucket_count, std::vector<uint32_t>());
+
+      for (uint32_t city = 0 ; city < cities.size() ; city++)
+      {
+        buckets[bucket(cell(cities[city].x), cell(cities[city].y))].push_back(city);
+      }
+    }
+
+    float cell_size;
+    uint32_t max_cell = 0;
+    std::vector<City> cities;
+    //! Identifiers of the cities of the cells of each bucket, the number of buckets is a power of two
+    std::vector<std::vector<uint32_t>> buckets;
+};
+
+//---------------------------------------------------------------//
+//                             Roads                             //
+//---------------------------------------------------------------//
+
+//! Cost of the steps of a road between neighbouring pixels. A step costs at least its length, more on a slope, at height,
+//! or over a river. The sea cannot be crossed. The cost is the same both ways.
+class Terrain_cost
+{
+  public :
+    Terrain_cost(const Layer<uint16_t> & height, const Layer<uint8_t> & water, uint32_t size, uint16_t ocean_height)
+    : height(height), water(water), size(size), ocean_height(ocean_height)
+    {
+      //Mean height difference between the land pixels and their bottom neighbor
+      uint64_t slope = 0;
+      uint64_t land = 0;
+      std::mutex mutex;
+
+      Thread_pool::get().parallel_for(0, size - 1, [&height, size, ocean_height, &slope, &land, &mutex] (uint64_t begin, uint64_t end)
+      {
+        uint64_t local_slope = 0;
+        uint64_t local_land = 0;
+
+        for (uint64_t pixel = begin * size ; pixel < end * size ; pixel++)
+        {
+          if ((height[pixel] >= ocean_height) and (height[pixel + size] >= ocean_height))
+          {
+            local_slope += std::abs(int32_t(height[pixel + size]) - height[pixel]);
+            local_land++;
+          }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        slope += local_slope;
+        land += local_land;
+      });
+
+      float mean_slope = std::max(1.0, double(slope) / std::max<uint64_t>(1, land));
+
+      const Config & config = Config::get();
+      slope_factor = config.road_slope_cost / (mean_slope * mean_slope);
+      altitude_factor = config.road_altitude_cost / (65536.0f - ocean_height);
+      river_cost = config.road_river_cost / 2;
+    }
+
+    uint32_t map_size() const
+    {
+      return size;
+    }
+
+    bool passable(uint64_t pixel) const
+    {
+      return height[pixel] >= ocean_height;
+    }
+
+    uint16_t pixel_height(uint64_t pixel) const
+    {
+      return height[pixel];
+    }
+
+    bool river(uint64_t pixel) const
+    {
+      return water[pixel] != 0;
+    }
+
+    //! Cost of a step between two passable neighbouring pixels, of length 1 or sqrt(2)
+    float step(uint64_t from, uint64_t to, float length) const
+    {
+      return step(height[from], water[from] != 0, height[to], water[to] != 0, length);
+    }
+
+    //! Cost of a step from the height and river of its pixels
+    float step(uint16_t from_height, bool from_river, uint16_t to_height, bool to_river, float length) const
+    {
+      float slope = (int32_t(to_height) - from_height) / length;
+      float altitude = (from_height + to_height) / 2.0f - ocean_height;
+
+      return length * (1 + slope * slope * slope_factor + altitude * altitude_factor) + river_cost * (from_river + to_river);
+    }
+
+  private :
+    const Layer<uint16_t> & height;
+    const Layer<uint8_t> & water;
+    uint32_t size;
+    uint16_t ocean_height;
+
+    float slope_factor;
+    float altitude_factor;
+    float river_cost;
+};
+
+//! Rectangle of pixels [x, x + width) x [y, y + height)
+struct Rectangle
+{
+  uint32_t x;
+  uint32_t y;
+  uint32_t width;
+  uint32_t height;
+};
+
+//! Cheapest paths between pixels of a small rectangle of the map, the pixels outside of it are ignored.
+//! The rectangle is copied with a border of impassable pixels, so the neighbors of its pixels are always in the copy and
+//! are found with a constant offset. The cost of the steps leaving each pixel is computed once per rectangle, and kept for
+//! the next searches in the same rectangle.
+class Local_search
+{
+  public :
+    Local_search(const Terrain_cost & cost) : cost(cost)
+    {
+    }
+
+    //! Search the cheapest paths from start to the targets, with Dijkstra, or A* when there is a single target.
+    //! \return Cost of the path to each target, HUGE_VALF if there is none
+    std::vector<float> run(const Rectangle & area, uint64_t start, const std::vector<uint64_t> & targets)
+    {
+      load(area);
+
+      std::vector<float> found(targets.size(), HUGE_VALF);
+      std::vector<uint32_t> target_cells;
+      for (uint64_t target : targets)
+      {
+        target_cells.push_back(cell(target));
+      }
+      uint32_t remaining = targets.size();
+
+      //The heuristic is the distance, a step costs at least its length
+      bool guided = (targets.size() == 1);
+      float goal_x = guided ? target_cells[0] / stride : 0;
+      float goal_y = guided ? target_cells[0] % stride : 0;
+
+      costs.assign(blocked.size(), HUGE_VALF);
+      parents.assign(blocked.size(), no_parent);
+      closed = blocked;
+
+      uint32_t first = cell(start);
+      costs[first] = 0;
+      open.clear();
+      open.push_back(Entry(0, first));
+
+      while ((not open.empty()) and (remaining > 0))
+      {
+        std::pop_heap(open.begin(), open.end(), later);
+        uint32_t current = open.back().second;
+        open.pop_back();
+
+        if (closed[current])
+        {
+          continue;
+        }
+        closed[current] = true;
+
+        for (uint32_t target = 0 ; target < target_cells.size() ; target++)
+        {
+          if ((target_cells[target] == current) and (found[target] == HUGE_VALF))
+          {
+            found[target] = costs[current];
+            remaining--;
+          }
+        }
+
+        for (uint8_t direction = 0 ; direction < 8 ; direction++)
+        {
+          uint32_t next = current + offsets[direction];
+
+          if (closed[next])
+          {
+            continue;
+          }
+
+          float next_cost = costs[current] + steps[8 * current + direction];
+          if (next_cost < costs[next])
+          {
+            costs[next] = next_cost;
+            parents[next] = direction ^ 1;
+
+            float estimate = 0;
+            if (guided)
+            {
+              float dx = float(next / stride) - goal_x;
+              float dy = float(next % stride) - goal_y;
+              estimate = std::sqrt(dx * dx + dy * dy);
+            }
+            open.push_back(Entry(next_cost + estimate, next));
+            std::push_heap(open.begin(), open.end(), later);
+          }
+        }
+      }
+
+      return found;
+    }
+
+    //! Append the path found by the last run from its start to target, without the start
+    void path(uint64_t target, std::vector<uint64_t> & pixels) const
+    {
+      std::vector<uint64_t> reversed;
+
+      for (uint32_t current = cell(target) ; parents[current] != no_parent ; )
+      {
+        reversed.push_back(pixel(current));
+        current += int32_t(stride) * neighbor_x[parents[current]] + neighbor_y[parents[current]];
+      }
+
+      pixels.insert(pixels.end(), reversed.rbegin(), reversed.rend());
+    }
+
+  private :
+    static const uint8_t no_parent = 255;
+
+    //! Offset of the 8 neighbors, the 4 first ones are the orthogonal ones, the opposite of a direction is direction ^ 1
+    static const int8_t neighbor_x[8];
+    static const int8_t neighbor_y[8];
+
+    typedef std::pair<float, uint32_t> Entry;
+
+    //! Order of the open cells in the heap, the cheapest first
+    static bool later(const Entry & first, const Entry & second)
+    {
+      return first.first > second.first;
+    }
+
+    //! Copy the rectangle and its border and compute the cost of the steps, the impassable pixels are blocked
+    void load(const Rectangle & area)
+    {
+      if (loaded and (area.x == this->area.x) and (area.y == this->area.y) and (area.width == this->area.width)
+       and (area.height == this->area.height))
+      {
+        return;
+      }
+
+      loaded = true;
+      this->area = area;
+      stride = area.height + 2;
+      uint64_t cells = uint64_t(area.width + 2) * stride;
+
+      std::vector<uint16_t> heights(cells, 0);
+      std::vector<uint8_t> rivers(cells, false);
+      blocked.assign(cells, true);
+
+      for (uint32_t x = 0 ; x < area.width ; x++)
+      {
+        for (uint32_t y = 0 ; y < area.height ; y++)
+        {
+          uint64_t pixel = uint64_t(cost.map_size()) * (area.x + x) + area.y + y;
+          uint32_t cell = (x + 1) * stride + y + 1;
+
+          heights[cell] = cost.pixel_height(pixel);
+          rivers[cell] = cost.river(pixel);
+          blocked[cell] = not cost.passable(pixel);
+        }
+      }
+
+      for (uint8_t direction = 0 ; direction < 8 ; direction++)
+      {
+        offsets[direction] = int32_t(stride) * neighbor_x[direction] + neighbor_y[direction];
+      }
+
+      //The steps toward the border are never taken, it is blocked
+      steps.assign(8 * cells, HUGE_VALF);
+      for (uint32_t cell = stride + 1 ; cell + stride + 1 < cells ; cell++)
+      {
+        for (uint8_t direction = 0 ; direction < 8 ; direction++)
+        {
+          uint32_t next = cell + offsets[direction];
+          steps[8 * cell + direction] = cost.step(heights[cell], rivers[cell], heights[next], rivers[next], (direction < 4) ? 1.0f : 1.41421356f);
+        }
+      }
+    }
+
+    uint32_t cell(uint64_t pixel) const
+    {
+      uint32_t size = cost.map_size();
+      return (pixel / size - area.x + 1) * stride + (pixel % size - area.y + 1);
+    }
+
+    uint64_t pixel(uint32_t cell) const
+    {
+      return uint64_t(cost.map_size()) * (area.x + cell / stride - 1) + area.y + cell % stride - 1;
+    }
+
+    const Terrain_cost & cost;
+    bool loaded = false;
+    Rectangle area;
+    //! Cells in a row of the copy
+    uint32_t stride;
+    //! Offset of the cell of each neighbor
+    int32_t offsets[8];
+
+    //! Impassable cells
+    std::vector<uint8_t> blocked;
+    //! Cost of the step toward each neighbor of each cell
+    std::vector<float> steps;
+
+    std::vector<float> costs;
+    //! Direction of the parent of each pixel on its cheapest path
+    std::vector<uint8_t> parents;
+    std::vector<uint8_t> closed;
+    std::vector<Entry> open;
+};
+
+const uint8_t Local_search::no_parent;
+const int8_t Local_search::neighbor_x[8] = {-1, 1, 0, 0, -1, 1, -1, 1};
+const int8_t Local_search::neighbor_y[8] = {0, 0, -1, 1, -1, 1, 1, -1};
+
+//! Abstract graph of the roads (hierarchical path-finding, HPA*). The map is split in clusters of cluster_size pixels, the
+//! nodes of the graph are the entrances between neighbouring clusters, linked across the border by a step and inside each
+//! cluster by the cheapest path between them. A path is searched in the graph, then refined in each cluster it goes
+//! through, instead of searching every pixel between its ends. The graph is built once, then only read by the searches.
+class Road_graph
+{
+  public :
+    //! Side in pixels of the clusters
+    static const uint32_t cluster_size = 32;
+
+    Road_graph(const Terrain_cost & cost) : cost(cost), size(cost.map_size()), clusters((size + cluster_size - 1) / cluster_size)
+    {
+      std::vector<Edge> links = find_entrances();
+      link_entrances(links);
+    }
+
+    //! State of the searches in the graph. It is reused by all the searches of a thread.
+    class Search
+    {
+      public :
+        Search(const Road_graph & graph) : graph(graph), local(graph.cost), costs(graph.nodes.size() + 2, HUGE_VALF),
+          parents(graph.nodes.size() + 2), closed(graph.nodes.size() + 2, false)
+        {
+        }
+
+        //! Cheapest path from start to goal, both included
+        //! \return false if there is no path
+        bool path(uint64_t start, uint64_t goal, std::vector<uint64_t> & pixels)
+        {
+          pixels.clear();
+
+          if (not graph.cost.passable(start) or not graph.cost.passable(goal))
+          {
+            return false;
+          }
+
+          //The ends are linked to the nodes of their cluster, and to each other when they share it
+          uint32_t start_node = graph.nodes.size();
+          uint32_t goal_node = start_node + 1;
+          start_links = links(start, goal, goal_node);
+          goal_links = links(goal, start, start_node);
+          goal_cluster = graph.cluster(goal);
+          goal_x = goal / graph.size;
+          goal_y = goal % graph.size;
+
+          bool found = search(start_node, goal_node, start, goal);
+
+          std::vector<uint32_t> route;
+          for (uint32_t node = goal_node ; found and (node != start_node) ; node = parents[node])
+          {
+            route.push_back(node);
+          }
+
+          for (uint32_t node : reached)
+          {
+            costs[node] = HUGE_VALF;
+            closed[node] = false;
+          }
+          reached.clear();
+
+          if (not found)
+          {
+            return false;
+          }
+
+          //Refine the route: the steps between clusters are already pixels, the others are searched inside their cluster
+          route.push_back(start_node);
+          std::reverse(route.begin(), route.end());
+          pixels.push_back(start);
+
+          for (uint32_t i = 1 ; i < route.size() ; i++)
+          {
+            uint64_t from = pixel(route[i - 1], start, goal);
+            uint64_t to = pixel(route[i], start, goal);
+
+            if (graph.cluster(from) == graph.cluster(to))
+            {
+              local.run(graph.area(graph.cluster(from)), from, std::vector<uint64_t>(1, to));
+              local.path(to, pixels);
+            }
+            else
+            {
+              pixels.push_back(to);
+            }
+          }
+
+          return true;
+        }
+
+      private :
+        uint64_t pixel(uint32_t node, uint64_t start, uint64_t goal) const
+        {
+          return (node < graph.nodes.size()) ? graph.nodes[node] : ((node == graph.nodes.size()) ? start : goal);
+        }
+
+        //! Nodes of the cluster of a pixel reachable from it, with the cost to reach them. The other end of the path, whose
+        //! node is other_node, is one of them if it is in the same cluster.
+        std::vector<std::pair<uint32_t, float>> links(uint64_t pixel, uint64_t other, uint32_t other_node)
+        {
+          uint32_t cluster = graph.cluster(pixel);
+          std::vector<uint64_t> targets(graph.nodes.begin() + graph.first_node[cluster], graph.nodes.begin() + graph.first_node[cluster + 1]);
+          if (graph.cluster(other) == cluster)
+          {
+            targets.push_back(other);
+          }
+
+          std::vector<float> found = local.run(graph.area(cluster), pixel, targets);
+
+          std::vector<std::pair<uint32_t, float>> links;
+          for (uint32_t target = 0 ; target < targets.size() ; target++)
+          {
+            if (found[target] != HUGE_VALF)
+            {
+              uint32_t node = graph.first_node[cluster] + target;
+              links.push_back(std::make_pair((node < graph.first_node[cluster + 1]) ? node : other_node, found[target]));
+            }
+          }
+          return links;
+        }
+
+        //! A* in the graph, the heuristic is the distance to the goal since a step costs at least its length
+        bool search(uint32_t start_node, uint32_t goal_node, uint64_t start, uint64_t goal)
+        {
+          typedef std::pair<float, uint32_t> Entry;
+          std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> open;
+
+          costs[start_node] = 0;
+          reached.push_back(start_node);
+          open.push(Entry(0, start_node));
+
+          while (not open.empty())
+          {
+            uint32_t node = open.top().second;
+            open.pop();
+
+            if (closed[node])
+            {
+              continue;
+            }
+            if (node == goal_node)
+            {
+              return true;
+            }
+            closed[node] = true;
+
+            if (node == start_node)
+            {
+              relax(open, node, start_links, start, goal);
+              continue;
+            }
+
+            for (uint64_t edge = graph.first_edge[node] ; edge < graph.first_edge[node + 1] ; edge++)
+            {
+              relax(open, node, graph.edges[edge], start, goal);
+            }
+            if (graph.cluster(graph.nodes[node]) == goal_cluster)
+            {
+              for (const std::pair<uint32_t, float> & link : goal_links)
+              {
+                if (link.first == node)
+                {
+                  relax(open, node, std::make_pair(goal_node, link.second), start, goal);
+                }
+              }
+            }
+          }
+
+          return false;
+        }
+
+        template <typename Queue>
+        void relax(Queue & open, uint32_t node, const std::pair<uint32_t, float> & edge, uint64_t start, uint64_t goal)
+        {
+          uint32_t next = edge.first;
+          float next_cost = costs[node] + edge.second;
+
+          if (closed[next] or (next_cost >= costs[next]))
+          {
+            return;
+          }
+
+          if (costs[next] == HUGE_VALF)
+          {
+            reached.push_back(next);
+          }
+          costs[next] = next_cost;
+          parents[next] = node;
+
+          uint64_t next_pixel = pixel(next, start, goal);
+          float dx = float(next_pixel / graph.size) - goal_x;
+          float dy = float(next_pixel % graph.size) - goal_y;
+          open.push(std::make_pair(next_cost + std::sqrt(dx * dx + dy * dy), next));
+        }
+
+        template <typename Queue>
+        void relax(Queue & open, uint32_t node, const std::vector<std::pair<uint32_t, float>> & edges, uint64_t start, uint64_t goal)
+        {
+          for (const std::pair<uint32_t, float> & edge : edges)
+          {
+            relax(open, node, edge, start, goal);
+          }
+        }
+
+        const Road_graph & graph;
+        Local_search local;
+
+        std::vector<std::pair<uint32_t, float>> start_links;
+        std::vector<std::pair<uint32_t, float>> goal_links;
+        uint32_t goal_cluster;
+        float goal_x;
+        float goal_y;
+
+        std::vector<float> costs;
+        std::vector<uint32_t> parents;
+        std::vector<bool> closed;
+        //! Nodes whose cost was set by the search, reset before the next one
+        std::vector<uint32_t> reached;
+    };
+
+    //! Number of entrances between the clusters
+    uint32_t node_count() const
+    {
+      return nodes.size();
+    }
+
+  private :
+    //! Segments of passable pixels along a border longer than this get an entrance at both ends instead of one in the middle
+    static const uint32_t long_entrance = 6;
+
+    //! Edge between two pixels, before they are numbered as nodes
+    struct Edge
+    {
+      uint64_t from;
+      uint64_t to;
+      float cost;
+    };
+
+    uint32_t cluster(uint64_t pixel) const
+    {
+      return (pixel / size) / cluster_size * clusters + (pixel % size) / cluster_size;
+    }
+
+    Rectangle area(uint32_t cluster) const
+    {
+      uint32_t x = cluster / clusters * cluster_size;
+      uint32_t y = cluster % clusters * cluster_size;
+      return Rectangle{x, y, std::min(cluster_size, size - x), std::min(cluster_size, size - y)};
+    }
+
+    uint32_t node(uint64_t pixel) const
+    {
+      std::pair<uint32_t, uint64_t> key(cluster(pixel), pixel);
+      return std::lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+    }
+
+    //! Walk the borders between the clusters, then number the entrances found cluster by cluster
+    //! \return Steps across the borders
+    std::vector<Edge> find_entrances()
+    {
+      std::vector<Edge> steps;
+
+      //Along the border between the rows x and x + 1 when vertical is false, the columns x and x + 1 otherwise
+      for (uint8_t vertical = 0 ; vertical < 2 ; vertical++)
+      {
+        for (uint32_t x = cluster_size - 1 ; x + 1 < size ; x += cluster_size)
+        {
+          for (uint32_t first = 0 ; first < size ; first += cluster_size)
+          {
+            uint32_t end = std::min(size, first + cluster_size);
+            uint32_t run = 0;
+
+            for (uint32_t y = first ; y <= end ; y++)
+            {
+              uint64_t from = vertical ? uint64_t(size) * y + x : uint64_t(size) * x + y;
+              uint64_t to = vertical ? from + 1 : from + size;
+
+              if ((y < end) and cost.passable(from) and cost.passable(to))
+              {
+                run++;
+                continue;
+              }
+
+              //End of a segment [y - run, y)
+              std::vector<uint32_t> entrances;
+              if (run >= long_entrance)
+              {
+                entrances = {y - run, y - 1};
+              }
+              else if (run > 0)
+              {
+                entrances = {y - (run + 1) / 2};
+              }
+
+              for (uint32_t entrance : entrances)
+              {
+                uint64_t entrance_from = vertical ? uint64_t(size) * entrance + x : uint64_t(size) * x + entrance;
+                uint64_t entrance_to = vertical ? entrance_from + 1 : entrance_from + size;
+                steps.push_back(Edge{entrance_from, entrance_to, cost.step(entrance_from, entrance_to, 1)});
+              }
+              run = 0;
+            }
+          }
+        }
+      }
+
+      for (const Edge & step : steps)
+      {
+        keys.push_back(std::make_pair(cluster(step.from), step.from));
+        keys.push_back(std::make_pair(cluster(step.to), step.to));
+      }
+      std::sort(keys.begin(), keys.end());
+      keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+      nodes.resize(keys.size());
+      first_node.assign(uint64_t(clusters) * clusters + 1, 0);
+      for (uint32_t node = 0 ; node < keys.size() ; node++)
+      {
+        nodes[node] = keys[node].second;
+        first_node[keys[node].first + 1]++;
+      }
+      for (uint32_t cluster = 0 ; cluster < uint64_t(clusters) * clusters ; cluster++)
+      {
+        first_node[cluster + 1] += first_node[cluster];
+      }
+
+      return steps;
+    }
+
+    //! Link the entrances of each cluster by their cheapest path inside the cluster, the clusters are split across the threads
+    void link_entrances(const std::vector<Edge> & steps)
+    {
+      std::vector<std::pair<uint32_t, std::pair<uint32_t, float>>> links;
+      for (const Edge & step : steps)
+      {
+        links.push_back(std::make_pair(node(step.from), std::make_pair(node(step.to), step.cost)));
+      }
+
+      std::mutex mutex;
+      Thread_pool::get().parallel_for(0, uint64_t(clusters) * clusters, [this, &links, &mutex] (uint64_t begin, uint64_t end)
+      {
+        Local_search local(cost);
+        std::vector<std::pair<uint32_t, std::pair<uint32_t, float>>> local_links;
+
+        for (uint32_t cluster = begin ; cluster < end ; cluster++)
+        {
+          for (uint32_t from = first_node[cluster] ; from + 1 < first_node[cluster + 1] ; from++)
+          {
+            std::vector<uint64_t> targets(nodes.begin() + from + 1, nodes.begin() + first_node[cluster + 1]);
+            std::vector<float> found = local.run(area(cluster), nodes[from], targets);
+
+            for (uint32_t target = 0 ; target < targets.size() ; target++)
+            {
+              if (found[target] != HUGE_VALF)
+              {
+                local_links.push_back(std::make_pair(from, std::make_pair(from + 1 + target, found[target])));
+              }
+            }
+          }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        links.insert(links.end(), local_links.begin(), local_links.end());
+      });
+
+      //The workers append their links in the order they finish, which decides the order of the edges of each node and so
+      //the winner of equal cost paths. Sorted, the graph is the same whatever the number of threads.
+      std::sort(links.begin(), links.end());
+
+      //Both directions of each link, stored node by node
+      first_edge.assign(nodes.size() + 1, 0);
+      for (const std::pair<uint32_t, std::pair<uint32_t, float>> & link : links)
+      {
+        first_edge[link.first + 1]++;
+        first_edge[link.second.first + 1]++;
+      }
+      for (uint32_t node = 0 ; node < nodes.size() ; node++)
+      {
+        first_edge[node + 1] += first_edge[node];
+      }
+
+      edges.resize(first_edge.back());
+      std::vector<uint64_t> next_edge(first_edge.begin(), first_edge.end() - 1);
+      for (const std::pair<uint32_t, std::pair<uint32_t, float>> & link : links)
+      {
+        edges[next_edge[link.first]++] = link.second;
+        edges[next_edge[link.second.first]++] = std::make_pair(link.first, link.second.second);
+      }
+    }
+
+    const Terrain_cost & cost;
+    uint32_t size;
+    //! Number of clusters on each side of the map
+    uint32_t clusters;
+
+    //! Pixel of each node, the nodes of a cluster follow each other
+    std::vector<uint64_t> nodes;
+    //! Cluster and pixel of each node, sorted, to find the node of a pixel
+    std::vector<std::pair<uint32_t, uint64_t>> keys;
+    //! First node of each cluster
+    std::vector<uint32_t> first_node;
+    //! First edge of each node, and the node at the other end and cost of each edge
+    std::vector<uint64_t> first_edge;
+    std::vector<std::pair<uint32_t, float>> edges;
+};
+
+const uint32_t Road_graph::cluster_size;
+
+//---------------------------------------------------------------//
+//                        Level of detail                        //
+//---------------------------------------------------------------//
+
+//! Lowest, highest and mean height of a part of the map
+struct Height_range
+{
+  uint16_t min;
+  uint16_t max;
+  uint16_t mean;
+};
+
+//! Quadtree of the heights of a map. The node (x, y) of a level l covers the pixels [x * 2^l, (x + 1) * 2^l) on both axes,
+//! clipped to the map, the level 0 being the pixels themselves. Each node keeps the range of the heights it covers, built
+//! from the four nodes below it, so a question such as "is there any land in this rectangle" reads a few nodes along the
+//! border of the rectangle instead of all its pixels.
+class Height_pyramid
+{
+  public :
+    //! Prepare the levels above the heights of a map of size * size pixels, the nodes are computed by reduce_rows
+    void resize(const Layer<uint16_t> & heights, uint32_t size)
+    {
+      this->heights = &heights;
+      this->size = size;
+
+      nodes.resize(1);
+      for (uint32_t level = 1 ; width(level - 1) > 1 ; level++)
+      {
+        nodes.push_back(std::vector<Height_range>(uint64_t(width(level)) * width(level)));
+      }
+    }
+
+    //! Number of levels, including the pixels, the last one has a single node
+    uint32_t levels() const
+    {
+      return nodes.size();
+    }
+
+    //! Nodes along each axis of a level
+    uint32_t width(uint32_t level) const
+    {
+      return ((size - 1) >> level) + 1;
+    }
+
+    //! Range of a node
+    Height_range node(uint32_t level, uint32_t x, uint32_t y) const
+    {
+      if (level == 0)
+      {
+        uint16_t height = (*heights)[uint64_t(size) * x + y];
+        return Height_range{height, height, height};
+      }
+      return nodes[level][uint64_t(width(level)) * x + y];
+    }
+
+    //! Compute the rows [first, end) of the nodes of a level from the level below, which must be computed
+    void reduce_rows(uint32_t level, uint32_t first, uint32_t end)
+    {
+      uint32_t below = width(level - 1);
+
+      for (uint32_t x = first ; x < end ; x++)
+      {
+        for (uint32_t y = 0 ; y < width(level) ; y++)
+        {
+          Range range;
+
+          for (uint32_t child_x = 2 * x ; child_x < std::min(2 * x + 2, below) ; child_x++)
+          {
+            for (uint32_t child_y = 2 * y ; child_y < std::min(2 * y + 2, below) ; child_y++)
+            {
+              range.add(node(level - 1, child_x, child_y), uint64_t(span(level - 1, child_x)) * span(level - 1, child_y));
+            }
+          }
+          nodes[level][uint64_t(width(level)) * x + y] = range.result();
+        }
+      }
+    }
+
+    //! Compute the nodes of a level from the level below, on the threads of the pool
+    void reduce(uint32_t level)
+    {
+      Thread_pool::get().parallel_for(0, width(level), [this, level] (uint64_t begin, uint64_t end)
+      {
+        reduce_rows(level, begin, end);
+      });
+    }
+
+    //! Range of the heights of the pixels [x, x + width) x [y, y + height), clipped to the map. The rectangle must not be
+    //! empty.
+    Height_range range(uint32_t x, uint32_t y, uint32_t width, uint32_t height) const
+    {
+      Range range;
+      visit(levels() - 1, 0, 0, x, std::min<uint64_t>(size, uint64_t(x) + width), y, std::min<uint64_t>(size, uint64_t(y) + height), range);
+      return range.result();
+    }
+
+  private :
+    //! Range of heights being merged, the mean is weighted by the pixels of each part
+    struct Range
+    {
+      uint16_t min = UINT16_MAX;
+      uint16_t max = 0;
+      uint64_t sum = 0;
+      uint64_t pixels = 0;
+
+      void add(const Height_range & range, uint64_t range_pixels)
+      {
+        min = std::min(min, range.min);
+        max = std::max(max, range.max);
+        sum += uint64_t(range.mean) * range_pixels;
+        pixels += range_pixels;
+      }
+
+      Height_range result() const
+      {
+        return Height_range{min, max, uint16_t((pixels == 0) ? 0 : (sum + pixels / 2) / pixels)};
+      }
+    };
+
+    //! Pixels covered by the node index of a level along an axis
+    uint32_t span(uint32_t level, uint32_t index) const
+    {
+      return std::min<uint64_t>(size, uint64_t(index + 1) << level) - (uint64_t(index) << level);
+    }
+
+    //! Merge in range the nodes under the node (x, y) of a level inside [first_x, end_x) x [first_y, end_y)
+    void visit(uint32_t level, uint32_t x, uint32_t y, uint32_t first_x, uint32_t end_x, uint32_t first_y, uint32_t end_y,
+               Range & range) const
+    {
+      uint64_t node_x = uint64_t(x) << level;
+      uint64_t node_y = uint64_t(y) << level;
+
+      if ((node_x >= end_x) or (node_x + span(level, x) <= first_x) or (node_y >= end_y) or (node_y + span(level, y) <= first_y))
+      {
+        return;
+      }
+
+      if ((node_x >= first_x) and (node_x + span(level, x) <= end_x) and (node_y >= first_y) and (node_y + span(level, y) <= end_y))
+      {
+        range.add(node(level, x, y), uint64_t(span(level, x)) * span(level, y));
+        return;
+      }
+
+      for (uint32_t child_x = 2 * x ; child_x < std::min(2 * x + 2, width(level - 1)) ; child_x++)
+      {
+        for (uint32_t child_y = 2 * y ; child_y < std::min(2 * y + 2, width(level - 1)) ; child_y++)
+        {
+          visit(level - 1, child_x, child_y, first_x, end_x, first_y, end_y, range);
+        }
+      }
+    }
+
+    const Layer<uint16_t> * heights = nullptr;
+    uint32_t size = 0;
+    std::vector<std::vector<Height_range>> nodes;  //Nodes of each level, the level 0 is the height layer
+};
+
+//---------------------------------------------------------------//
+//                          Image files                          //
+//---------------------------------------------------------------//
+
+//! File created at its final length and mapped in memory, so several threads can write their part of it directly without
+//! any copy through stdio buffers. The data is synchronised according to Config::sync_policy when the file is released.
+class Mapped_file
+{
+  public :
+    Mapped_file(std::string name, uint64_t length) : name(name), length(length)
+    {
+      descriptor = open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+      if ((descriptor < 0) or (ftruncate(descriptor, length) != 0))
+      {
+        printf("Error : Cannot open %s\n", name.c_str());
+        exit(1);
+      }
+
+      memory = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+
+      if (memory == MAP_FAILED)
+      {
+        printf("Error : Cannot map %s in memory\n", name.c_str());
+        exit(1);
+      }
+    }
+
+    ~Mapped_file()
+    {
+      Sync_policy policy = Config::get().sync_policy;
+
+      if (((policy == Sync_policy::async) and (msync(memory, length, MS_ASYNC) != 0))
+       or ((policy == Sync_policy::sync) and ((msync(memory, length, MS_SYNC) != 0) or (fsync(descriptor) != 0))))
+      {
+        printf("Error : Cannot write %s\n", name.c_str());
+        exit(1);
+      }
+
+      munmap(memory, length);
+      close(descriptor);
+    }
+
+    uint8_t * data() const
+    {
+      return (uint8_t *)memory;
+    }
+
+  private :
+    Mapped_file(const Mapped_file &rhs);
+    Mapped_file &operator=(const Mapped_file &rhs);
+
+    std::string name;
+    uint64_t length;
+    int descriptor;
+    void * memory;
+};
+
+//! Bands of an image written in order by a thread of their own, so the encoding of the next bands overlaps the writing of
+//! the previous ones. The bands are taken from a fixed set of buffers, which bounds the memory used: the encoding waits for
+//! a free buffer when the writing is behind.
+class Band_writer
+{
+  public :
+    //! Write in fp bands of at most band_bytes bytes, with at most bands buffers
+    Band_writer(FILE * fp, uint64_t band_bytes, uint32_t bands) : fp(fp)
+    {
+      buffers.resize(std::max(2u, bands), std::vector<uint8_t>(band_bytes));
+
+      for (std::vector<uint8_t> & buffer : buffers)
+      {
+        free_bands.push(buffer.data());
+      }
+
+      writer = std::thread(&Band_writer::write, this);
+    }
+
+    //! Wait for the last bands to be written
+    ~Band_writer()
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished = true;
+      }
+      changed.notify_all();
+      writer.join();
+    }
+
+    //! Buffer for the next band, wait until one is free
+    uint8_t * acquire()
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      changed.wait(lock, [this] { return not free_bands.empty(); });
+
+      uint8_t * band = free_bands.front();
+      free_bands.pop();
+      return band;
+    }
+
+    //! Write the first bytes of a band after the bands pushed before
+    void push(uint8_t * band, uint64_t bytes)
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push(std::make_pair(band, bytes));
+      }
+      changed.notify_all();
+    }
+
+  private :
+    Band_writer(const Band_writer &rhs);
+    Band_writer &operator=(const Band_writer &rhs);
+
+    //! Main loop of the writer thread
+    void write()
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+
+      while (true)
+      {
+        changed.wait(lock, [this] { return finished or not pending.empty(); });
+
+        if (pending.empty())
+        {
+          return;
+        }
+
+        std::pair<uint8_t *, uint64_t> band = pending.front();
+        pending.pop();
+        lock.unlock();
+
+        if (fwrite(band.first, 1, band.second, fp) != band.second)
+        {
+          printf("Error : Cannot write image\n");
+          exit(1);
+        }
+
+        lock.lock();
+        free_bands.push(band.first);
+        changed.notify_all();
+      }
+    }
+
+    FILE * fp;
+    std::vector<std::vector<uint8_t>> buffers;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::queue<uint8_t *> free_bands;
+    std::queue<std::pair<uint8_t *, uint64_t>> pending;  //Bands to write, in order
+    bool finished = false;
+    std::thread writer;
+};
+
+//---------------------------------------------------------------//
+//                           Map files                           //
+//---------------------------------------------------------------//
+
+//! Parameters of Config that change the layers of a map. They are stored in the map files, a file is only loaded by a
+//! configuration producing the same map.
+struct Map_parameters
+{
+  uint32_t size;
+  uint32_t seed;
+  uint32_t corner_heights[4];
+  uint32_t ocean_height;
+  float roughness;
+  uint32_t height_engine;
+  uint32_t fbm_octaves;
+  float fbm_wavelength;
+  float fbm_persistence;
+  float fbm_lacunarity;
+  float smooth_factor;
+  float smooth_pass;
+  uint32_t spring_max;
+  float river_area;
+  float rivers_size;
+  float moisture_distance;
+  float road_slope_cost;
+  float road_altitude_cost;
+  float road_river_cost;
+  uint32_t city_max;
+  float city_spacing;
+  float city_radius;
+
+  //! Parameters of the current configuration for a map of map_size pixels and the seed
+  static Map_parameters current(uint32_t map_size, uint32_t seed)
+  {
+    const Config & config = Config::get();
+
+    return Map_parameters{map_size, seed,
+                          {config.left_top_corner_height, config.right_top_corner_height,
+                           config.left_bottom_corner_height, config.right_bottom_corner_height},
+                          config.ocean_height, config.roughness, uint32_t(config.height_engine), config.fbm_octaves,
+                          config.fbm_wavelength, config.fbm_persistence, config.fbm_lacunarity,
+                          config.smooth_factor, config.smooth_pass,
+                          config.spring_max, config.river_area, config.rivers_size, config.moisture_distance,
+                          config.road_slope_cost, config.road_altitude_cost, config.road_river_cost,
+                          config.city_max, config.city_spacing, config.city_radius};
+  }
+
+  bool operator==(const Map_parameters & other) const
+  {
+    return memcmp(this, &other, sizeof(Map_parameters)) == 0;
+  }
+};
+
+//! Stages of the map generator, in the order they run
+enum class Map_stage
+{
+  height,    //!< Diamond-square or fbm heights
+  smooth,    //!< Smoothing of the heights
+  rivers,    //!< Rivers drawn in the water layer
+  moisture,  //!< Moisture from the distance to the water
+  cities,    //!< Sites of the cities
+  road,      //!< Roads between the cities
+  count
+};
+
+//! Hash of a list of values, see Map_stage_node
+inline uint64_t hash_values(std::initializer_list<uint64_t> values)
+{
+  uint64_t hash = 0;
+
+  for (uint64_t value : values)
+  {
+    hash = hash_mix(hash ^ value);
+  }
+  return hash;
+}
+
+//! Bits of a float, to hash it
+inline uint64_t float_bits(float value)
+{
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+//! Node of the dependency graph of the stages: the stages whose output a stage reads, and the hash of the parameters it reads
+struct Map_stage_node
+{
+  Map_stage stage;
+  std::vector<Map_stage> inputs;
+  std::function<uint64_t (const Map_parameters &)> parameters;
+};
+
+//! Dependency graph of the stages of the map generator, in the order they run. Every stage reads ocean_height through the
+//! sea level, the fbm heights are placed around it.
+inline const std::vector<Map_stage_node> & map_stage_graph()
+{
+  static const std::vector<Map_stage_node> graph = {
+    {Map_stage::height, {}, [] (const Map_parameters & p)
+      {
+        return hash_values({p.size, p.seed, p.ocean_height, p.corner_heights[0], p.corner_heights[1], p.corner_heights[2],
+                            p.corner_heights[3], float_bits(p.roughness), p.height_engine, p.fbm_octaves,
+                            float_bits(p.fbm_wavelength), float_bits(p.fbm_persistence), float_bits(p.fbm_lacunarity)});
+      }},
+    {Map_stage::smooth, {Map_stage::height}, [] (const Map_parameters & p)
+      {
+        return hash_values({float_bits(p.smooth_factor), float_bits(p.smooth_pass)});
+      }},
+    {Map_stage::rivers, {Map_stage::smooth}, [] (const Map_parameters & p)
+      {
+        return hash_values({p.ocean_height, p.spring_max, float_bits(p.river_area), float_bits(p.rivers_size)});
+      }},
+    {Map_stage::moisture, {Map_stage::smooth, Map_stage::rivers}, [] (const Map_parameters & p)
+      {
+        return hash_values({p.ocean_height, float_bits(p.moisture_distance)});
+      }},
+    {Map_stage::cities, {Map_stage::smooth, Map_stage::rivers, Map_stage::moisture}, [] (const Map_parameters & p)
+      {
+        return hash_values({p.ocean_height, p.city_max, float_bits(p.city_spacing), float_bits(p.city_radius)});
+      }},
+    {Map_stage::road, {Map_stage::smooth, Map_stage::rivers, Map_stage::cities}, [] (const Map_parameters & p)
+      {
+        return hash_values({p.ocean_height, float_bits(p.road_slope_cost), float_bits(p.road_altitude_cost),
+                            float_bits(p.road_river_cost)});
+      }}
+  };
+
+  return graph;
+}
+
+//! Key of the output of each stage for the parameters: the hash of the parameters the stage reads and of the keys of its
+//! inputs. Two maps whose stage has the same key have the same output for this stage.
+inline void map_stage_keys(const Map_parameters & parameters, uint64_t keys[uint32_t(Map_stage::count)])
+{
+  for (const Map_stage_node & node : map_stage_graph())
+  {
+    uint64_t key = hash_mix(uint64_t(node.stage) ^ node.parameters(parameters));
+
+    for (Map_stage input : node.inputs)
+    {
+      key = hash_mix(key ^ keys[uint32_t(input)]);
+    }
+
+    keys[uint32_t(node.stage)] = key;
+  }
+}
+
+//! Header of a map file. The file is made to be mapped in memory and used without any copy: the values are in the byte order
+//! of the machine, and each layer starts on a page and is stored like in memory, row major. The header is followed by the
+//! cities and by the checksums of the tiles, then by the height, water, moisture and road layers.
+struct Map_file_header
+{
+  //! Changed each time the layout of the file or the meaning of a layer changes
+  static const uint32_t current_version = 2;
+
+  char magic[8];  //"MAPLAYER"
+  uint32_t version;
+  uint32_t byte_order;  //0x01020304 written in the byte order of the machine
+  uint32_t checksum_tile;  //Pixels of the side of the tiles whose checksum is stored, 0 without checksums
+  uint32_t city_count;
+  Map_parameters parameters;
+  uint32_t padding;  //0, aligns the offsets
+  uint64_t layers[4];  //Offset of the height, water, moisture and road layers
+  uint64_t cities;  //Offset of the cities
+  uint64_t checksums;  //Offset of the checksums of the tiles, row of tiles after row of tiles
+  uint64_t length;  //Length of the file
+};
+
+static_assert(sizeof(Map_file_header) == 184, "The map file header must not have any padding");
+
+//! Checksum of length bytes following the checksum hash of the previous bytes, fast enough to check a map file at the speed
+//! of the memory
+inline uint64_t data_checksum(const uint8_t * data, uint64_t length, uint64_t hash)
+{
+  uint64_t word;
+
+  for ( ; length >= 8 ; data += 8, length -= 8)
+  {
+    memcpy(&word, data, 8);
+    hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+    hash ^= hash >> 32;
+  }
+
+  word = length;
+  memcpy(&word, data, length);
+  return hash_mix(hash ^ word);
+}
+
+//! Image saved by Map::save_images, the color picker is only used by the colored images
+struct Map_image
+{
+  Image_content content;
+  std::string name;
+  const Color_picker * color_picker;
+};
+
+//---------------------------------------------------------------//
+//                         Map generator                         //
+//---------------------------------------------------------------//
+
+class Map
+{
+  friend class Benchmark;
+
+  public:
+    //! Map of Config::seed, loaded from Config::map_file when it holds this map
+    Map()
+    {
+      const std::string & file = Config::get().map_file;
+
+      if (file.empty() or not load_file(file, configured_size()))
+      {
+        init(configured_size());
+        generate(Config::get().seed);
+
+        if (not file.empty())
+        {
+          save_file(file);
+        }
+      }
+    }
+
+    //! Allocate an empty map of map_size * map_size pixels, generate runs the stages
+    explicit Map(uint32_t map_size)
+    {
+      init(map_size);
+    }
+
+    //! The memory of the layers is kept for the next maps
+    ~Map()
+    {
+      if (region.data != nullptr)
+      {
+        Arena::get().release(region);
+      }
+
+      if (file_memory != nullptr)
+      {
+        munmap(file_memory, file_length);
+      }
+    }
+
+    //! Run every stage for a seed. The layers of the map are reused, so a map can be generated again for another seed
+    //! without allocating its memory again.
+    void generate(uint32_t seed)
+    {
+      std::fill(stage_keys, stage_keys + uint32_t(Map_stage::count), 0);
+      run_stages(seed, false);
+    }
+
+    //! Bring the map up to date with the configuration, for example after a parameter is tuned: only the stages whose
+    //! parameters or inputs changed since they ran are run again (see map_stage_graph). The heights before smoothing are
+    //! kept, so the smoothing can be tuned without running diamond-square again. The size of the map does not change.
+    //! \return Number of stages run
+    uint32_t update()
+    {
+      return run_stages(Config::get().seed, true);
+    }
+
+    //! Size of the maps asked by Config::map_size: the power of two below it plus one for diamond-square, itself for fbm
+    static uint32_t configured_size()
+    {
+      uint32_t map_size = Config::get().map_size;
+
+      if (Config::get().height_engine == Height_engine::fbm)
+      {
+        return std::max(2u, map_size);
+      }
+
+      //If not a power of two, find the nearest power of two by decrementing
+      while(not is_power_of_two(map_size))
+      {
+        map_size--;
+      }
+
+      //The + 1
+      return map_size + 1;
+    }
+
+    //! Memory used to generate and save a map of map_size * map_size pixels: its layers, and the largest temporary layers
+    //! of the stages
+    static uint64_t memory_per_map(uint32_t map_size)
+    {
+      return uint64_t(map_size) * map_size * (layers_bytes_per_pixel + stage_bytes_per_pixel);
+    }
+
+    //! Build a map from a tile of an unbounded world, see World::tile.
+    //! Only the height is generated: the other stages look at the whole map, so they would break the seams between tiles.
+    Map(const World & world, int64_t tile_x, int64_t tile_y, uint32_t tile_size)
+    {
+      init(tile_size + 1);
+
+      Stage_timer stage("Computing world tile");
+      std::vector<uint16_t> tile = world.tile(tile_x, tile_y, tile_size);
+      std::copy(tile.begin(), tile.end(), _height.data());
+    }
+    
+      
+    //! Save the map to a file. Use the color picker to obtain the colors.
+    //! The image is written as raw PPM (P6) unless Config::image_format asks for the plain (P3) compatibility mode.
+    void save(const Color_picker * color_picker, std::string name)
+    {
+      if (color_picker == nullptr)
+      {
+        printf("Error : Cannot save map whithout color picker\n");
+        exit(1);
+      }
+
+      //Without occlusion a pipelined image computes the hillshade of each row while encoding it, which saves a pass over
+      //the whole map. The rows are stored in the shade buffer as usual, so the next saves reuse them.
+      Light light;
+      bool streamed = (Config::get().image_output == Image_output::pipelined) and
+                      (Config::get().image_format == Image_format::binary) and (light.occlusion <= 0) and
+                      not (shaded and (light == shade_light));
+
+      if (not streamed)
+      {
+        shade();
+      }
+
+      Stage_timer stage("Saving map", size);
+
+      if (streamed)
+      {
+        if (_shade.data() == nullptr)
+        {
+          _shade.allocate(size, file_backed);
+        }
+
+        Hillshade hillshade(light);
+
+        write_rows(name + ".ppm", image_header("P6", 255), size * 3, stage,
+                   [this, color_picker, &hillshade] (uint32_t x, uint8_t * row)
+        {
+          uint8_t * shades = &_shade[uint64_t(size) * x];
+
+          shade_row(x, hillshade, shades);
+          render_row(color_picker, x, (Color *)row, shades);
+        });
+
+        _shade.flush(0, size);
+        shade_light = light;
+        shaded = true;
+      }
+      else if (Config::get().image_format == Image_format::ascii)
+      {
+        FILE * fp = open_image(name + ".ppm");
+
+        fprintf(fp, "P3\n");
+        fprintf(fp, "%u %u\n", size, size);
+        fprintf(fp, "255\n");
+
+        std::vector<Color> colors(size);
+
+        for (uint32_t x = 0 ; x < size ; x++)
+        {
+          stage.advance();
+
+          render_row(color_picker, x, colors.data(), &_shade[uint64_t(size) * x]);
+
+          for (const Color & color : colors)
+          {
+            fprintf(fp, "%d %d %d ", color.red, color.green, color.blue);
+          }
+          fprintf(fp, "\n");
+        }
+
+        close_image(fp);
+      }
+      else
+      {
+        //A Color is exactly the 3 bytes of a P6 pixel, so the rows are colorized in place
+        write_rows(name + ".ppm", image_header("P6", 255), size * 3, stage, [this, color_picker] (uint32_t x, uint8_t * row)
+        {
+          render_row(color_picker, x, (Color *)row, &_shade[uint64_t(size) * x]);
+        });
+      }
+    }
+
+    //! Save the raw height of each pixel as a 16 bits greyscale PGM (P5), samples are big endian as required by the format
+    void save_height_map(std::string name)
+    {
+      Stage_timer stage("Saving height map", size);
+
+      write_rows(name + ".pgm", image_header("P5", 65535), size * 2, stage, [this] (uint32_t x, uint8_t * row)
+      {
+        encode_height_row(x, row);
+      });
+    }
+
+    //! Save the moisture of each pixel as a 8 bits greyscale PGM (P5)
+    void save_moisture_map(std::string name)
+    {
+      Stage_timer stage("Saving moisture map", size);
+
+      write_rows(name + ".pgm", image_header("P5", 255), size, stage, [this] (uint32_t x, uint8_t * row)
+      {
+        const uint8_t * moisture = &_moisture[uint64_t(size) * x];
+        std::copy(moisture, moisture + size, row);
+      });
+    }
+
+    //! Save several images of the map in a single pass: each band of rows is read once and encoded into every image while
+    //! the row is still in the cache, then each image writes its bands with a thread of its own (see Band_writer), or the
+    //! bands are encoded directly in the files mapped in memory when Config::image_output asks for it. The hillshade is
+    //! computed in the same pass when it is not already in the shade buffer and needs no occlusion.
+    //! The plain (P3) format has no bands, each image is then saved on its own.
+    void save_images(const std::vector<Map_image> & images)
+    {
+      bool colored = false;
+
+      for (const Map_image & image : images)
+      {
+        if ((image.content == Image_content::colors) and (image.color_picker == nullptr))
+        {
+          printf("Error : Cannot save map whithout color picker\n");
+          exit(1);
+        }
+
+        colored = colored or (image.content == Image_content::colors);
+      }
+
+      if (Config::get().image_format == Image_format::ascii)
+      {
+        for (const Map_image & image : images)
+        {
+          switch (image.content)
+          {
+            case Image_content::colors   : save(image.color_picker, image.name); break;
+            case Image_content::height   : save_height_map(image.name); break;
+            case Image_content::moisture : save_moisture_map(image.name); break;
+          }
+        }
+        return;
+      }
+
+      Light light;
+      bool streamed = colored and (light.occlusion <= 0) and not (shaded and (light == shade_light));
+
+      if (colored and not streamed)
+      {
+        shade();
+      }
+
+      if (colored and (_shade.data() == nullptr))
+      {
+        _shade.allocate(size, file_backed);
+      }
+
+      Stage_timer stage("Saving maps", size);
+
+      //Mapped in memory, the bands are encoded directly in the files. Otherwise they are written by a thread per image.
+      bool mapped = (Config::get().image_output == Image_output::memory_map);
+      uint32_t band_rows = std::max(1u, Config::get().band_rows);
+      std::vector<FILE *> files;
+      std::vector<uint32_t> row_bytes;
+      std::vector<std::unique_ptr<Band_writer>> writers;
+      std::vector<std::unique_ptr<Mapped_file>> mappings;
+      std::vector<uint8_t *> mapped_rows;
+
+      for (const Map_image & image : images)
+      {
+        const char * extension = (image.content == Image_content::colors) ? ".ppm" : ".pgm";
+        std::string header;
+
+        switch (image.content)
+        {
+          case Image_content::colors   : header = image_header("P6", 255);   row_bytes.push_back(size * 3); break;
+          case Image_content::height   : header = image_header("P5", 65535); row_bytes.push_back(size * 2); break;
+          case Image_content::moisture : header = image_header("P5", 255);   row_bytes.push_back(size); break;
+        }
+
+        if (mapped)
+        {
+          mappings.emplace_back(new Mapped_file(image.name + extension, header.size() + uint64_t(row_bytes.back()) * size));
+          std::copy(header.begin(), header.end(), mappings.back()->data());
+          mapped_rows.push_back(mappings.back()->data() + header.size());
+          continue;
+        }
+
+        files.push_back(open_image(image.name + extension));
+        write_image(files.back(), (const uint8_t *)header.data(), header.size());
+
+        writers.emplace_back(new Band_writer(files.back(), uint64_t(row_bytes.back()) * band_rows,
+                                             Config::get().bands_in_flight));
+      }
+
+      Hillshade hillshade(light);
+      std::vector<uint8_t *> bands(images.size());
+
+      for (uint32_t x = 0 ; x < size ; x += band_rows)
+      {
+        uint32_t rows = std::min(band_rows, size - x);
+
+        for (uint32_t i = 0 ; i < images.size() ; i++)
+        {
+          bands[i] = mapped ? mapped_rows[i] + uint64_t(row_bytes[i]) * x : writers[i]->acquire();
+        }
+
+        Thread_pool::get().parallel_for(0, rows, [&, x] (uint64_t begin, uint64_t end)
+        {
+          for (uint32_t row = begin ; row < end ; row++)
+          {
+            const uint8_t * shades = colored ? &_shade[uint64_t(size) * (x + row)] : nullptr;
+
+            if (streamed)
+            {
+              shade_row(x + row, hillshade, &_shade[uint64_t(size) * (x + row)]);
+            }
+
+            for (uint32_t i = 0 ; i < images.size() ; i++)
+            {
+              uint8_t * encoded = bands[i] + uint64_t(row_bytes[i]) * row;
+
+              switch (images[i].content)
+              {
+                case Image_content::colors   : render_row(images[i].color_picker, x + row, (Color *)encoded, shades); break;
+                case Image_content::height   : encode_height_row(x + row, encoded); break;
+                case Image_content::moisture :
+                  std::copy(&_moisture[uint64_t(size) * (x + row)], &_moisture[uint64_t(size) * (x + row)] + size, encoded);
+                  break;
+              }
+            }
+          }
+        });
+
+        for (uint32_t i = 0 ; i < writers.size() ; i++)
+        {
+          writers[i]->push(bands[i], uint64_t(rows) * row_bytes[i]);
+        }
+        stage.advance(rows);
+      }
+
+      //Wait for the last bands before closing the files, the mappings are synced as asked by Config::sync_policy
+      writers.clear();
+      mappings.clear();
+
+      for (FILE * fp : files)
+      {
+        close_image(fp);
+      }
+
+      if (streamed)
+      {
+        _shade.flush(0, size);
+        shade_light = light;
+        shaded = true;
+      }
+    }
+
+    //! Render stage computing the shade of each pixel: hillshading from the normal of the terrain and the sun position,
+    //! optionally darkened by ambient occlusion. The shade buffer is reused by every save until the light changes.
+    void shade()
+    {
+      Light light;
+
+      if (shaded and (light == shade_light))
+      {
+        return;
+      }
+
+      //A step per row of the hillshade and of each occlusion sweep
+      Stage_timer stage("Shading relief", uint64_t(size) * (1 + occlusion_sweeps(light)));
+
+      if (_shade.data() == nullptr)
+      {
+        _shade.allocate(size, file_backed);
+      }
+
+      if (light.occlusion > 0)
+      {
+        ambient_occlusion(light, stage);
+      }
+
+      Hillshade hillshade(light);
+
+      Thread_pool::get().parallel_for(0, size, [this, &hillshade, &stage] (uint64_t begin, uint64_t end)
+      {
+        for (uint32_t x = begin ; x < end ; x++)
+        {
+          shade_row(x, hillshade, &_shade[uint64_t(size) * x]);
+        }
+
+        _shade.flush(begin, end - begin);
+        stage.advance(end - begin);
+      });
+
+      shade_light = light;
+      shaded = true;
+    }
+
+    //! Save the layers and the cities of the map in a map file, see Map_file_header
+    void save_file(const std::string & name)
+    {
+      Stage_timer stage("Saving map file", size);
+
+      Map_file_header header = file_header(Config::get().map_file_checksums ? file_checksum_tile : 0);
+      Mapped_file file(name, header.length);
+      uint8_t * data = file.data();
+
+      memcpy(data, &header, sizeof(header));
+
+      for (uint32_t city = 0 ; city < _cities.size() ; city++)
+      {
+        memcpy(data + header.cities + uint64_t(city) * sizeof(City), &_cities[city], sizeof(City));
+      }
+
+      const uint8_t * layers[4] = {(const uint8_t *)_height.data(), _water.data(), _moisture.data(), _road.data()};
+      const uint64_t pixel_bytes[4] = {sizeof(uint16_t), 1, 1, 1};
+
+      Thread_pool::get().parallel_for(0, size, [&] (uint64_t begin, uint64_t end)
+      {
+        for (uint32_t layer = 0 ; layer < 4 ; layer++)
+        {
+          uint64_t row_bytes = size * pixel_bytes[layer];
+          memcpy(data + header.layers[layer] + begin * row_bytes, layers[layer] + begin * row_bytes, (end - begin) * row_bytes);
+        }
+        stage.advance(end - begin);
+      });
+
+      if (header.checksum_tile != 0)
+      {
+        file_checksums(header, data, (uint64_t *)(data + header.checksums));
+      }
+    }
+
+    //! Use the layers of a map file generated for a map of map_size pixels with the current configuration. The file is
+    //! mapped in memory privately: the layers are read from the file when first used, and a layer changed later, for
+    //! example by generate, is copied in memory without changing the file.
+    //! \return false if the file does not exist, is not a map file of this version or holds another map
+    bool load_file(const std::string & name, uint32_t map_size)
+    {
+      int descriptor = open(name.c_str(), O_RDONLY);
+
+      if (descriptor < 0)
+      {
+        return false;
+      }
+
+      struct stat info;
+      Map_file_header header;
+
+      bool valid = (fstat(descriptor, &info) == 0) and (uint64_t(info.st_size) >= sizeof(header))
+                   and (pread(descriptor, &header, sizeof(header), 0) == sizeof(header))
+                   and (memcmp(header.magic, "MAPLAYER", 8) == 0) and (header.version == Map_file_header::current_version)
+                   and (header.byte_order == 0x01020304) and (header.length == uint64_t(info.st_size));
+
+      if (not valid)
+      {
+        close(descriptor);
+        printf("%s is not a map file of this version, the map is generated again\n", name.c_str());
+        return false;
+      }
+
+      if (not (header.parameters == Map_parameters::current(map_size, Config::get().seed)))
+      {
+        close(descriptor);
+        printf("%s holds the map of other parameters, the map is generated again\n", name.c_str());
+        return false;
+      }
+
+      //The offsets are used without any other check, they must be the ones this version writes for these parameters
+      Map_file_header expected = file_header(map_size, header.parameters.seed, header.city_count, header.checksum_tile);
+
+      if ((header.cities != expected.cities) or (header.checksums != expected.checksums)
+          or (memcmp(header.layers, expected.layers, sizeof(header.layers)) != 0) or (header.length != expected.length))
+      {
+        close(descriptor);
+        printf("%s has a damaged layout, the map is generated again\n", name.c_str());
+        return false;
+      }
+
+      void * memory = mmap(nullptr, header.length, PROT_READ | PROT_WRITE, MAP_PRIVATE, descriptor, 0);
+      close(descriptor);
+
+      if (memory == MAP_FAILED)
+      {
+        printf("Error : Cannot map %s in memory\n", name.c_str());
+        exit(1);
+      }
+
+      if ((header.checksum_tile != 0) and Config::get().map_file_checksums)
+      {
+        std::vector<uint64_t> checksums(file_checksum_count(header));
+
+        {
+          Stage_timer stage("Checking map file");
+          file_checksums(header, (const uint8_t *)memory, checksums.data());
+        }
+
+        if (memcmp(checksums.data(), (const uint8_t *)memory + header.checksums, checksums.size() * sizeof(uint64_t)) != 0)
+        {
+          munmap(memory, header.length);
+          printf("%s is corrupted, the map is generated again\n", name.c_str());
+          return false;
+        }
+      }
+
+      Stage_timer stage("Loading map file");
+
+      //The layers of a previous map go back to the arena, the map now uses the ones of the file
+      if (region.data != nullptr)
+      {
+        Arena::get().release(region);
+        region = {nullptr, 0};
+      }
+
+      if (file_memory != nullptr)
+      {
+        munmap(file_memory, file_length);
+      }
+
+      file_memory = (uint8_t *)memory;
+      file_length = header.length;
+      size = map_size;
+      seed = header.parameters.seed;
+
+      uint64_t budget = Config::get().memory_budget;
+      file_backed = (budget != 0) and (uint64_t(size) * size * layers_bytes_per_pixel > budget);
+
+      _height.attach(file_memory + header.layers[0], size);
+      _water.attach(file_memory + header.layers[1], size);
+      _moisture.attach(file_memory + header.layers[2], size);
+      _road.attach(file_memory + header.layers[3], size);
+      _shade.allocate(size, file_backed);
+
+      _cities = City_index(std::max(1.0f, Config::get().city_spacing * size));
+      for (uint32_t city = 0 ; city < header.city_count ; city++)
+      {
+        City loaded;
+        memcpy(&loaded, file_memory + header.cities + uint64_t(city) * sizeof(City), sizeof(City));
+        _cities.add(loaded);
+      }
+
+      shaded = false;
+      pyramid_built = false;
+      map_stage_keys(header.parameters, stage_keys);
+      raw_height_key = 0;
+      return true;
+    }
+
+    //! Hillshade of the row x, the first and last rows use their own heights as neighbours
+    void shade_row(uint32_t x, const Hillshade & hillshade, uint8_t * shade) const
+    {
+      const uint16_t * row = &_height[uint64_t(size) * x];
+      const uint16_t * above = (x > 0) ? row - size : row;
+      const uint16_t * below = (x + 1 < size) ? row + size : row;
+
+      hillshade_row(above, row, below, size, hillshade, shade);
+    }
+
+    //! Save the map as a pyramid of tiles of Config::tile_size pixels, in name/z/x/y.ppm. The zoom level 0 is a single tile
+    //! with the whole map, each zoom level doubles the resolution up to the pixels of the map. x is the column of a tile and
+    //! y its row. The last row and column of the map repeat the border of the diamond-square algorithm and are left out, so
+    //! a map of 2^n + 1 pixels fills whole tiles. The pixels of a level are the mean of the four pixels below them.
+    //! The bands of pixels are rendered, tiled and reduced on several threads, then each level is reduced from the one
+    //! below, the height pyramid (see height_pyramid) in the same pass.
+    void save_tiles(const Color_picker * color_picker, std::string name)
+    {
+      if (color_picker == nullptr)
+      {
+        printf("Error : Cannot save map whithout color picker\n");
+        exit(1);
+      }
+
+      uint32_t tile = Config::get().tile_size;
+      if ((tile < 2) or not is_power_of_two(tile))
+      {
+        printf("Error : The tile size %u is not a power of two\n", tile);
+        exit(1);
+      }
+
+      shade();
+
+      _pyramid.resize(_height, size);
+
+      std::vector<uint32_t> widths = tile_widths(size, tile);
+      uint32_t tiled = widths[0];
+      uint32_t zoom_max = widths.size() - 1;
+
+      //A step per row of pixels, then per level
+      Stage_timer stage("Saving tiles", tiled + _pyramid.levels());
+
+      //The directories of the tiles of each column
+      make_directory(name);
+      for (uint32_t level = 0 ; level <= zoom_max ; level++)
+      {
+        std::string zoom = name + "/" + std::to_string(zoom_max - level);
+        make_directory(zoom);
+
+        for (uint32_t column = 0 ; column < (widths[level] + tile - 1) / tile ; column++)
+        {
+          make_directory(zoom + "/" + std::to_string(column));
+        }
+      }
+
+      //Colors of the levels above the pixels
+      std::vector<std::vector<Color>> colors(zoom_max + 1);
+      for (uint32_t level = 1 ; level <= zoom_max ; level++)
+      {
+        colors[level].resize(uint64_t(widths[level]) * widths[level]);
+      }
+
+      //The pixels are rendered by bands of a row of tiles
+      Thread_pool::get().parallel_for(0, (tiled + tile - 1) / tile, [&] (uint64_t begin, uint64_t end)
+      {
+        std::vector<Color> pixels(uint64_t(tile) * size);
+
+        for (uint32_t band = begin ; band < end ; band++)
+        {
+          uint32_t first = band * tile;
+          uint32_t rows = std::min(tile, tiled - first);
+
+          for (uint32_t row = 0 ; row < rows ; row++)
+          {
+            render_row(color_picker, first + row, &pixels[uint64_t(size) * row], &_shade[uint64_t(size) * (first + row)]);
+          }
+
+          write_tiles(name + "/" + std::to_string(zoom_max), band, pixels.data(), size, tiled, rows);
+
+          if (zoom_max > 0)
+          {
+            downsample(pixels.data(), size, tiled, rows, &colors[1][uint64_t(widths[1]) * (first / 2)]);
+          }
+          _pyramid.reduce_rows(1, first / 2, (first + rows + 1) / 2);
+
+          stage.advance(rows);
+        }
+      });
+
+      //The heights of the last row
+      _pyramid.reduce_rows(1, (tiled + 1) / 2, _pyramid.width(1));
+
+      for (uint32_t level = 1 ; level < _pyramid.levels() ; level++)
+      {
+        if (level > 1)
+        {
+          _pyramid.reduce(level);
+        }
+
+        if (level <= zoom_max)
+        {
+          uint32_t width = widths[level];
+          uint32_t below = widths[level - 1];
+          std::string zoom = name + "/" + std::to_string(zoom_max - level);
+
+          //The level 1 is reduced with the bands of pixels
+          if (level > 1)
+          {
+            Thread_pool::get().parallel_for(0, width, [&colors, level, width, below] (uint64_t begin, uint64_t end)
+            {
+              downsample(&colors[level - 1][uint64_t(below) * 2 * begin], below, below, std::min<uint64_t>(2 * end, below) - 2 * begin,
+                         &colors[level][uint64_t(width) * begin]);
+            });
+          }
+
+          Thread_pool::get().parallel_for(0, (width + tile - 1) / tile, [this, &colors, &zoom, level, width, tile] (uint64_t begin, uint64_t end)
+          {
+            for (uint32_t band = begin ; band < end ; band++)
+            {
+              write_tiles(zoom, band, &colors[level][uint64_t(width) * band * tile], width, width, std::min(tile, width - band * tile));
+            }
+          });
+        }
+
+        stage.advance();
+      }
+
+      pyramid_built = true;
+    }
+
+    //! Pixels along each axis of the levels of the tiles of a map of map_size pixels, from the pixels of the map (level 0,
+    //! the last zoom level) up to a single tile (the zoom level 0), see save_tiles
+    static std::vector<uint32_t> tile_widths(uint32_t map_size, uint32_t tile)
+    {
+      std::vector<uint32_t> widths(1, is_power_of_two(map_size - 1) ? map_size - 1 : map_size);
+
+      while (widths.back() > tile)
+      {
+        widths.push_back((widths.back() + 1) / 2);
+      }
+      return widths;
+    }
+
+    //! Header of the PPM files of the tiles of Config::tile_size pixels
+    static std::string tile_header()
+    {
+      uint32_t tile = Config::get().tile_size;
+      return "P6\n" + std::to_string(tile) + " " + std::to_string(tile) + "\n255\n";
+    }
+
+    //! Render the tile of a column and a row of the tiles of the pixels of the map (the last zoom level of save_tiles) in
+    //! colors, Config::tile_size colors per row. The colors out of the map are left as they are. shade() must be up to date.
+    void render_tile(const Color_picker * color_picker, uint32_t column, uint32_t band, Color * colors) const
+    {
+      uint32_t tile = Config::get().tile_size;
+      uint32_t tiled = tile_widths(size, tile)[0];
+      uint32_t rows = std::min(tile, tiled - band * tile);
+      uint32_t columns = std::min(tile, tiled - column * tile);
+
+      for (uint32_t row = 0 ; row < rows ; row++)
+      {
+        uint64_t first = uint64_t(size) * (band * tile + row) + column * tile;
+        render_pixels(color_picker, first, columns, colors + uint64_t(tile) * row, &_shade[first]);
+      }
+    }
+
+    //! Reduce rows of an image of width pixels, stride colors apart, to half its size, each pixel being the mean of the 4
+    //! pixels above it. The last row and column are doubled when they are alone.
+    static void downsample(const Color * source, uint32_t stride, uint32_t width, uint32_t rows, Color * target)
+    {
+      uint32_t target_width = (width + 1) / 2;
+
+      for (uint32_t x = 0 ; x < (rows + 1) / 2 ; x++)
+      {
+        const Color * above = source + uint64_t(stride) * 2 * x;
+        const Color * below = source + uint64_t(stride) * std::min(2 * x + 1, rows - 1);
+
+        for (uint32_t y = 0 ; y < target_width ; y++)
+        {
+          uint32_t left = 2 * y;
+          uint32_t right = std::min(2 * y + 1, width - 1);
+
+          target[uint64_t(target_width) * x + y] = Color{
+            uint8_t((above[left].red + above[right].red + below[left].red + below[right].red + 2) / 4),
+            uint8_t((above[left].green + above[right].green + below[left].green + below[right].green + 2) / 4),
+            uint8_t((above[left].blue + above[right].blue + below[left].blue + below[right].blue + 2) / 4)};
+        }
+      }
+    }
+
+    //! Quadtree of the heights of the map, to know the range of the heights of a rectangle without reading its pixels.
+    //! Built by save_tiles, or when first asked for.
+    const Height_pyramid & height_pyramid()
+    {
+      if (not pyramid_built)
+      {
+        Stage_timer stage("Computing height pyramid");
+
+        _pyramid.resize(_height, size);
+        for (uint32_t level = 1 ; level < _pyramid.levels() ; level++)
+        {
+          _pyramid.reduce(level);
+        }
+        pyramid_built = true;
+      }
+      return _pyramid;
+    }
+
+    //! Cities placed by generate_cities
+    const City_index & cities() const
+    {
+      return _cities;
+    }
+
+    uint16_t height_max()
+    {
+      uint16_t max = 0;
+      for (uint64_t i = 0 ; i < uint64_t(size) * size ; i++)
+      {
+        if (_height[i] > max)
+        {
+          max = _height[i];
+        }
+      }
+      return max;
+    }
+
+    uint16_t height_min()
+    {
+      uint16_t min = 65535;
+      for (uint64_t i = 0 ; i < uint64_t(size) * size ; i++)
+      {
+        if (_height[i] < min)
+        {
+          min = _height[i];
+        }
+      }
+      return min;
+    }
+
+  private:
+    //! Number of lines processed together by an ambient occlusion sweep
+    static const uint32_t occlusion_line_group = 16;
+
+    //! Number of columns processed by a thread during a rows smoothing sweep
+    static const uint32_t smooth_row_chunk = 256;
+    //! Number of rows smoothed together by a columns smoothing sweep
+    static const uint32_t smooth_column_block = 32;
+    //! Number of columns transposed at once by a columns smoothing sweep
+    static const uint32_t smooth_column_tile = 64;
+
+    //! Number of columns scanned at once when looking for the nearest water of each column
+    static const uint32_t moisture_column_block = 64;
+
+    //! Side in pixels of the blocks whose sites are rated when placing the cities
+    static const uint32_t city_block = 8;
+
+    //! State of a pixel while the rivers are selected
+    static const uint8_t river_unknown = 0;
+    static const uint8_t river_kept = 1;
+    static const uint8_t river_dropped = 2;
+
+    //! Bytes used by the layers for each pixel: height, water, moisture, road and shade
+    static const uint32_t layers_bytes_per_pixel = 6;
+    //! Bytes of the temporary layers of the most hungry stage for each pixel: the drainage directions, accumulations and
+    //! donors, and the river states
+    static const uint32_t stage_bytes_per_pixel = 7;
+
+    //! Pixels of the side of the tiles whose checksum is stored in the map files
+    static const uint32_t file_checksum_tile = 256;
+
+    //! Size of the buffer used to encode the images before writing them
+    static const uint32_t write_buffer_size = 1 << 20;
+
+    //! Open an image file for writing, exit if it cannot be created
+    FILE * open_image(std::string file_name)
+    {
+      FILE * fp = fopen(file_name.c_str(), "wb");
+
+      if (fp == nullptr)
+      {
+        printf("Error : Cannot open %s\n", file_name.c_str());
+        exit(1);
+      }
+
+      return fp;
+    }
+
+    //! Write an encoded block of an image, exit on failure
+    void write_image(FILE * fp, const uint8_t * data, size_t length)
+    {
+      if (fwrite(data, 1, length, fp) != length)
+      {
+        printf("Error : Cannot write image\n");
+        exit(1);
+      }
+    }
+
+    //! Close an image file, waiting for its data to reach the disk if Config::sync_policy asks for it
+    void close_image(FILE * fp)
+    {
+      if ((fflush(fp) != 0) or ((Config::get().sync_policy == Sync_policy::sync) and (fsync(fileno(fp)) != 0)))
+      {
+        printf("Error : Cannot write image\n");
+        exit(1);
+      }
+
+      fclose(fp);
+    }
+
+    //! Header of a binary PNM image of the map
+    std::string image_header(const char * magic, uint32_t max_value)
+    {
+      char header[64];
+      snprintf(header, sizeof(header), "%s\n%u %u\n%u\n", magic, size, size, max_value);
+      return header;
+    }
+
+    //! Write a binary image made of a header followed by one row of row_bytes bytes per row of the map.
+    //! The rows are encoded by encode_row(x, row) on several threads, either in a buffer written with a few large fwrite, or
+    //! directly in the file mapped in memory when Config::image_output asks for it.
+    void write_rows(std::string file_name, const std::string & header, uint32_t row_bytes, Stage_timer & stage,
+                    const std::function<void(uint32_t x, uint8_t * row)> & encode_row)
+    {
+      if (Config::get().image_output == Image_output::memory_map)
+      {
+        Mapped_file file(file_name, header.size() + uint64_t(row_bytes) * size);
+        std::copy(header.begin(), header.end(), file.data());
+
+        uint8_t * rows = file.data() + header.size();
+
+        Thread_pool::get().parallel_for(0, size, [rows, row_bytes, &stage, &encode_row] (uint64_t begin, uint64_t end)
+        {
+          for (uint32_t x = begin ; x < end ; x++)
+          {
+            encode_row(x, rows + uint64_t(row_bytes) * x);
+          }
+          stage.advance(end - begin);
+        });
+        return;
+      }
+
+      if (Config::get().image_output == Image_output::pipelined)
+      {
+        FILE * fp = open_image(file_name);
+        write_image(fp, (const uint8_t *)header.data(), header.size());
+
+        uint32_t band_rows = std::max(1u, Config::get().band_rows);
+
+        {
+          Band_writer writer(fp, uint64_t(row_bytes) * band_rows, Config::get().bands_in_flight);
+
+          for (uint32_t x = 0 ; x < size ; x += band_rows)
+          {
+            uint32_t rows = std::min(band_rows, size - x);
+            uint8_t * band = writer.acquire();
+
+            Thread_pool::get().parallel_for(0, rows, [band, x, row_bytes, &encode_row] (uint64_t begin, uint64_t end)
+            {
+              for (uint32_t row = begin ; row < end ; row++)
+              {
+                encode_row(x + row, band + uint64_t(row_bytes) * row);
+              }
+            });
+
+            writer.push(band, uint64_t(rows) * row_bytes);
+            stage.advance(rows);
+          }
+        }
+
+        close_image(fp);
+        return;
+      }
+
+      FILE * fp = open_image(file_name);
+      write_image(fp, (const uint8_t *)header.data(), header.size());
+
+      //Rows are encoded into a buffer big enough to hold several of them, so the file is written with a few large fwrite
+      uint32_t rows_per_write = std::max<uint32_t>(1, write_buffer_size / row_bytes);
+      std::vector<uint8_t> buffer(uint64_t(row_bytes) * rows_per_write);
+
+      for (uint32_t x = 0 ; x < size ; x += rows_per_write)
+      {
+        uint32_t rows = std::min(rows_per_write, size - x);
+
+        Thread_pool::get().parallel_for(0, rows, [&buffer, x, row_bytes, &encode_row] (uint64_t begin, uint64_t end)
+        {
+          for (uint32_t row = begin ; row < end ; row++)
+          {
+            encode_row(x + row, &buffer[uint64_t(row_bytes) * row]);
+          }
+        });
+
+        write_image(fp, buffer.data(), uint64_t(rows) * row_bytes);
+        stage.advance(rows);
+      }
+
+      close_image(fp);
+    }
+
+    //! Write the tiles of a band of rows of an image of a level of a pyramid of tiles, see save_tiles. The band is the row of
+    //! the tiles in the directory of the zoom level, its rows are stride colors apart.
+    void write_tiles(const std::string & zoom, uint32_t band, const Color * pixels, uint32_t stride, uint32_t width, uint32_t rows)
+    {
+      uint32_t tile = Config::get().tile_size;
+      std::string header = tile_header();
+      std::vector<Color> colors(uint64_t(tile) * tile);
+
+      for (uint32_t column = 0 ; column < (width + tile - 1) / tile ; column++)
+      {
+        uint32_t first = column * tile;
+        uint32_t columns = std::min(tile, width - first);
+
+        std::fill(colors.begin(), colors.end(), Color{0, 0, 0});
+        for (uint32_t row = 0 ; row < rows ; row++)
+        {
+          std::copy(pixels + uint64_t(stride) * row + first, pixels + uint64_t(stride) * row + first + columns,
+                    &colors[uint64_t(tile) * row]);
+        }
+
+        FILE * fp = open_image(zoom + "/" + std::to_string(column) + "/" + std::to_string(band) + ".ppm");
+        write_image(fp, (const uint8_t *)header.data(), header.size());
+        write_image(fp, (const uint8_t *)colors.data(), colors.size() * sizeof(Color));
+        close_image(fp);
+      }
+    }
+
+    //! Create a directory if it does not exist, exit on failure
+    static void make_directory(const std::string & path)
+    {
+      if ((mkdir(path.c_str(), 0755) != 0) and (errno != EEXIST))
+      {
+        printf("Error : Cannot create the directory %s\n", path.c_str());
+        exit(1);
+      }
+    }
+
+    //! Big endian 16 bits heights of a row of the map, as required by the PGM format
+    void encode_height_row(uint32_t x, uint8_t * row)
+    {
+      const uint16_t * heights = &_height[uint64_t(size) * x];
+
+      for (uint32_t y = 0 ; y < size ; y++)
+      {
+        *row++ = heights[y] >> 8;
+        *row++ = heights[y] & 0xFF;
+      }
+    }
+
+    //! Colors of a row of the map, including the relief effect of the shades of the row (see shade())
+    void render_row(const Color_picker * color_picker, uint32_t x, Color * colors, const uint8_t * shade) const
+    {
+      render_pixels(color_picker, uint64_t(size) * x, size, colors, shade);
+    }
+
+    //! Colors of count pixels of a row of the map from the pixel first, including the relief effect of their shades
+    void render_pixels(const Color_picker * color_picker, uint64_t first, uint32_t count, Color * colors,
+                       const uint8_t * shade) const
+    {
+      // Get colors from the color picker
+      color_picker->colorize(&_height[first], &_moisture[first], count, colors);
+
+      const Color river_color = Config::get().river_color;
+      const Color road_color = Config::get().road_color;
+      const uint8_t * water = &_water[first];
+      const uint8_t * road = &_road[first];
+
+      for (uint32_t y = 0 ; y < count ; y++)
+      {
+        // if the pixel is water (river or lac, use dedicated color)
+        if (water[y] != 0)
+        {
+          colors[y] = river_color;
+        }
+
+        // the roads cross the rivers on bridges
+        if (road[y] != 0)
+        {
+          colors[y] = road_color;
+        }
+
+        //The color is altered by the relief
+        colors[y] = shade_color(colors[y], shade[y]);
+      }
+    }
+
+    //! Store in _shade the occlusion of each pixel: the mean over several directions of the sinus of the horizon elevation.
+    //! Each direction is a sweep along parallel lines keeping the horizon of the points seen so far (see Horizon).
+    void ambient_occlusion(const Light & light, Stage_timer & stage)
+    {
+      //The sweeps add to the shade buffer, which still holds the previous shading
+      _shade.zero();
+
+      //Directions of the sweeps, the horizon is searched behind the sweep
+      const int8_t directions[8][2] = {{0, 1}, {0, -1}, {1, 0}, {-1, 0}, {1, 1}, {-1, -1}, {1, -1}, {-1, 1}};
+      uint8_t count = occlusion_sweeps(light);
+      float weight = 255.0f / count;
+      float z_scale = light.level / 65535;
+
+      for (uint8_t i = 0 ; i < count ; i++)
+      {
+        occlusion_sweep(directions[i][0], directions[i][1], z_scale, weight);
+        stage.advance(size);
+      }
+    }
+
+    //! Number of directions swept by ambient_occlusion, 0 without occlusion
+    static uint8_t occlusion_sweeps(const Light & light)
+    {
+      if (light.occlusion <= 0)
+      {
+        return 0;
+      }
+      return (light.directions >= 8) ? 8 : 4;
+    }
+
+    //! Add the occlusion in one direction to _shade. Lines along the rows are processed one by one, the other lines are
+    //! processed by groups of adjacent ones walking down (or up) the rows, so each row access is contiguous.
+    void occlusion_sweep(int8_t step_x, int8_t step_y, float z_scale, float weight)
+    {
+      const uint32_t group = occlusion_line_group;
+
+      if (step_x == 0)
+      {
+        Thread_pool::get().parallel_for(0, size, [this, step_y, z_scale, weight] (uint64_t begin, uint64_t end)
+        {
+          std::vector<float> hull(2 * size);
+
+          for (uint32_t x = begin ; x < end ; x++)
+          {
+            Horizon horizon = {hull.data(), hull.data() + size, 0};
+
+            for (uint32_t i = 0 ; i < size ; i++)
+            {
+              uint64_t index = uint64_t(size) * x + ((step_y > 0) ? i : size - 1 - i);
+              _shade[index] += uint8_t(weight * horizon.add(i, _height[index] * z_scale));
+            }
+          }
+        });
+        return;
+      }
+
+      //A line is identified by its column on the first row of the sweep, diagonal lines may start outside of the map
+      int64_t first_line = (step_y > 0) ? 1 - int64_t(size) : 0;
+      int64_t last_line = (step_y < 0) ? 2 * int64_t(size) - 2 : size - 1;
+      float distance = (step_y == 0) ? 1 : std::sqrt(2.0f);
+
+      Thread_pool::get().parallel_for(0, (last_line - first_line) / group + 1,
+        [this, step_x, step_y, z_scale, weight, group, first_line, last_line, distance] (uint64_t begin, uint64_t end)
+      {
+        std::vector<float> hull(2 * group * size);
+        std::vector<Horizon> horizons(group);
+
+        for (uint64_t index = begin ; index < end ; index++)
+        {
+          int64_t first = first_line + index * group;
+          int64_t last = std::min<int64_t>(first + group - 1, last_line);
+
+          for (uint32_t line = 0 ; line < group ; line++)
+          {
+            horizons[line] = {&hull[2 * line * size], &hull[(2 * line + 1) * size], 0};
+          }
+
+          for (uint32_t i = 0 ; i < size ; i++)
+          {
+            uint32_t x = (step_x > 0) ? i : size - 1 - i;
+
+            //Columns of the group lines on this row, clipped to the map
+            int64_t first_y = std::max<int64_t>(first + step_y * int64_t(i), 0);
+            int64_t last_y = std::min<int64_t>(last + step_y * int64_t(i), size - 1);
+
+            for (int64_t y = first_y ; y <= last_y ; y++)
+            {
+              uint64_t pixel = uint64_t(size) * x + y;
+              Horizon & horizon = horizons[y - step_y * int64_t(i) - first];
+              _shade[pixel] += uint8_t(weight * horizon.add(i * distance, _height[pixel] * z_scale));
+            }
+          }
+        }
+      });
+    }
+
+    //! Header of the map file of this map, with checksums of tiles of checksum_tile pixels (0 for none)
+    Map_file_header file_header(uint32_t checksum_tile) const
+    {
+      return file_header(size, seed, _cities.size(), checksum_tile);
+    }
+
+    //! Header of the map file of a map of map_size pixels, the seed and city_count cities in the current configuration
+    static Map_file_header file_header(uint32_t map_size, uint32_t seed, uint32_t city_count, uint32_t checksum_tile)
+    {
+      const uint64_t page = 4096;
+
+      Map_file_header header;
+      memcpy(header.magic, "MAPLAYER", 8);
+      header.version = Map_file_header::current_version;
+      header.byte_order = 0x01020304;
+      header.checksum_tile = checksum_tile;
+      header.city_count = city_count;
+      header.parameters = Map_parameters::current(map_size, seed);
+      header.padding = 0;
+      header.cities = sizeof(header);
+      header.checksums = header.cities + uint64_t(header.city_count) * sizeof(City);
+
+      uint64_t offset = header.checksums + file_checksum_count(header) * sizeof(uint64_t);
+      const uint64_t pixel_bytes[4] = {sizeof(uint16_t), 1, 1, 1};
+
+      for (uint32_t layer = 0 ; layer < 4 ; layer++)
+      {
+        header.layers[layer] = (offset + page - 1) / page * page;
+        offset = header.layers[layer] + uint64_t(map_size) * map_size * pixel_bytes[layer];
+      }
+
+      header.length = offset;
+      return header;
+    }
+
+    //! Number of tiles whose checksum is stored in a map file
+    static uint64_t file_checksum_count(const Map_file_header & header)
+    {
+      if (header.checksum_tile == 0)
+      {
+        return 0;
+      }
+
+      uint64_t tiles = (header.parameters.size + header.checksum_tile - 1) / header.checksum_tile;
+      return tiles * tiles;
+    }
+
+    //! Compute the checksum of each tile of the layers of a map file, a row of tiles per thread
+    static void file_checksums(const Map_file_header & header, const uint8_t * data, uint64_t * checksums)
+    {
+      uint32_t size = header.parameters.size;
+      uint32_t tile = header.checksum_tile;
+      uint32_t tiles = (size + tile - 1) / tile;
+      const uint64_t pixel_bytes[4] = {sizeof(uint16_t), 1, 1, 1};
+
+      Thread_pool::get().parallel_for(0, tiles, [&] (uint64_t begin, uint64_t end)
+      {
+        for (uint32_t tile_x = begin ; tile_x < end ; tile_x++)
+        {
+          for (uint32_t tile_y = 0 ; tile_y < tiles ; tile_y++)
+          {
+            uint32_t rows = std::min(tile, size - tile_x * tile);
+            uint32_t columns = std::min(tile, size - tile_y * tile);
+            uint64_t hash = 0;
+
+            for (uint32_t layer = 0 ; layer < 4 ; layer++)
+            {
+              for (uint32_t row = 0 ; row < rows ; row++)
+              {
+                uint64_t pixel = uint64_t(size) * (tile_x * tile + row) + tile_y * tile;
+                hash = data_checksum(data + header.layers[layer] + pixel * pixel_bytes[layer],
+                                     columns * pixel_bytes[layer], hash);
+              }
+            }
+
+            checksums[uint64_t(tiles) * tile_x + tile_y] = hash;
+          }
+        }
+      });
+    }
+
+    //! Prepare the layers for a new map of the seed, to run the stages one by one. The other layers are fully written by
+    //! their stage.
+    void reset(uint32_t seed)
+    {
+      this->seed = seed;
+      _water.fill(0);
+      _road.fill(0);
+      shaded = false;
+      pyramid_built = false;
+      std::fill(stage_keys, stage_keys + uint32_t(Map_stage::count), 0);
+    }
+
+    //! Run the stages whose key for the seed and the configuration differs from the key of their output, and the stages
+    //! reading them. The heights before smoothing are copied to _raw_height if keep_raw_height is true.
+    //! \return Number of stages run
+    uint32_t run_stages(uint32_t seed, bool keep_raw_height)
+    {
+      const uint32_t count = uint32_t(Map_stage::count);
+      const uint32_t height = uint32_t(Map_stage::height);
+      const uint32_t smooth = uint32_t(Map_stage::smooth);
+
+      uint64_t keys[count];
+      map_stage_keys(Map_parameters::current(size, seed), keys);
+      this->seed = seed;
+
+      bool stale[count];
+      for (uint32_t stage = 0 ; stage < count ; stage++)
+      {
+        stale[stage] = (keys[stage] != stage_keys[stage]);
+      }
+
+      //The smoothing works in place, without the heights before smoothing they are computed again
+      if (stale[smooth] and (raw_height_key != keys[height]))
+      {
+        stale[height] = true;
+      }
+
+      uint32_t run = 0;
+
+      for (uint32_t stage = 0 ; stage < count ; stage++)
+      {
+        if (not stale[stage])
+        {
+          continue;
+        }
+
+        switch (Map_stage(stage))
+        {
+          case Map_stage::height :
+            generate_height();
+            raw_height_key = 0;
+
+            if (keep_raw_height)
+            {
+              if (_raw_height.data() == nullptr)
+              {
+                _raw_height.allocate(size, file_backed);
+              }
+              copy_layer(_height, _raw_height);
+              raw_height_key = keys[height];
+            }
+            break;
+
+          case Map_stage::smooth :
+            if (not stale[height])
+            {
+              copy_layer(_raw_height, _height);
+            }
+            height_smooth();
+            shaded = false;
+            pyramid_built = false;
+            break;
+
+          case Map_stage::rivers :
+            _water.fill(0);
+            generate_rivers();
+            break;
+
+          case Map_stage::moisture :
+            generate_moisture();
+            break;
+
+          case Map_stage::cities :
+            generate_cities();
+            break;
+
+          case Map_stage::road :
+            _road.fill(0);
+            generate_road();
+            break;
+
+          case Map_stage::count :
+            break;
+        }
+
+        stage_keys[stage] = keys[stage];
+        run++;
+      }
+
+      return run;
+    }
+
+    //! Copy the heights of a layer in another one, on every thread
+    void copy_layer(const Layer<uint16_t> & source, Layer<uint16_t> & target)
+    {
+      Thread_pool::get().parallel_for(0, size, [this, &source, &target] (uint64_t begin, uint64_t end)
+      {
+        std::copy(source.data() + begin * size, source.data() + end * size, target.data() + begin * size);
+        target.flush(begin, end - begin);
+      });
+    }
+
+    //! Allocate the layers for a map of map_size * map_size pixels
+    void init(uint32_t map_size)
+    {
+      Stage_timer stage("Initializing map generator");
+
+      size = map_size;
+      seed = Config::get().seed;
+
+      //Maps that do not fit in the memory budget are stored in files, including the shade computed when saving
+      uint64_t budget = Config::get().memory_budget;
+      file_backed = (budget != 0) and (uint64_t(size) * size * layers_bytes_per_pixel > budget);
+
+      if (file_backed)
+      {
+        //The layers are zeroed when allocated, the shade is allocated when saving
+        _height.allocate(size, file_backed);
+        _water.allocate(size, file_backed);
+        _moisture.allocate(size, file_backed);
+        _road.allocate(size, file_backed);
+        return;
+      }
+
+      //The layers in memory share a single region
+      uint64_t offsets[5] = {0};
+      offsets[1] = offsets[0] + Layer<uint16_t>::bytes(size);
+      offsets[2] = offsets[1] + Layer<uint8_t>::bytes(size);
+      offsets[3] = offsets[2] + Layer<uint8_t>::bytes(size);
+      offsets[4] = offsets[3] + Layer<uint8_t>::bytes(size);
+
+      region = Arena::get().acquire(offsets[4] + Layer<uint8_t>::bytes(size));
+
+      _height.attach(region.data + offsets[0], size);
+      _water.attach(region.data + offsets[1], size);
+      _moisture.attach(region.data + offsets[2], size);
+      _road.attach(region.data + offsets[3], size);
+      _shade.attach(region.data + offsets[4], size);
+
+      _height.zero();
+      _water.zero();
+      _moisture.zero();
+      _road.zero();
+      _shade.zero();
+    }
+
+    //Compute the height map with the algorithm of Config::height_engine
+    void generate_height()
+    { 
+      if (Config::get().height_engine == Height_engine::fbm)
+      {
+        fbm_height();
+        return;
+      }
+
+      if (not is_power_of_two(size - 1))
+      {
+        printf("Error : diamond-square needs a map of a power of two plus one pixels, not %u\n", size);
+        exit(1);
+      }
+
+      //use Diamond-square algorithm to compote the height map
+      //http://en.wikipedia.org/wiki/Diamond-square_algorithm
+      //Each level is computed by several threads. The random offsets are keyed on (seed, level, x, y) instead of being
+      //drawn in sequence, so a seed always produce the same map whatever the number of threads.
+      //A step per level, size is a power of two + 1
+      Stage_timer stage("Computing height map", uint32_t(std::log2(size - 1)));
+
+      diamond_square(_height, stage);
+    }
+
+    //! Fbm heights, see Fbm_noise. The rows are independent and computed by all the threads.
+    void fbm_height()
+    {
+      Stage_timer stage("Computing height map", size);
+      Fbm_noise noise(seed, size, Config::get().simd_level);
+
+      Thread_pool::get().parallel_for(0, size, [this, &noise, &stage] (uint64_t begin, uint64_t end)
+      {
+        for (uint64_t x = begin ; x < end ; x++)
+        {
+          noise.row(x, size, &_height(x, 0));
+        }
+        stage.advance(end - begin);
+      });
+    }
+
+    //! Diamond-square algorithm on a height layer of the map size in any layout, see generate_height
+    template <typename Layout>
+    void diamond_square(Layer<uint16_t, Layout> & heights, Stage_timer & stage)
+    {
+      //Set the initial corners
+      heights(0, 0) = Config::get().left_top_corner_height;
+      heights(0, size - 1) = Config::get().right_top_corner_height;
+      heights(size - 1, 0) = Config::get().left_bottom_corner_height;
+      heights(size - 1, size - 1) = Config::get().right_bottom_corner_height;
+      
+      //Each step of the algorithme, the map is splitted in smaler squares
+      for (uint32_t square_size = size ; square_size > 2 ; square_size =  square_size / 2 + 1)
+      {      
+        stage.advance();
+
+        uint32_t half = square_size / 2;
+        uint32_t step = square_size - 1;
+
+        //For each squares, compute it's center coordinates. A square center only depends on the previous levels, so the rows
+        //of centers are independent.
+        Thread_pool::get().parallel_for(0, (size - 1) / step, [this, &heights, square_size, half, step] (uint64_t begin, uint64_t end)
+        {
+          for (uint32_t x = half + begin * step ; x < half + end * step ; x = x + step)
+          {
+            for (uint32_t y = half ; y < size ; y = y + step)
+            {
+              //center value equal the mean of the square corners
+              uint32_t mean = (heights(x - half, y - half) + heights(x - half, y + half)
+                             + heights(x + half, y - half) + heights(x + half, y + half)) / 4;
+
+              heights(x, y) = mean + height_offset(square_size, x, y);
+            }
+          }
+        });
+
+        //For each diamond, compute it's center coordinates. The diamond corners are square centers or points of the previous
+        //levels, so the rows of diamonds are independent too.
+        Thread_pool::get().parallel_for(0, (size - 1) / half + 1, [this, &heights, square_size, half, step] (uint64_t begin, uint64_t end)
+        {
+          for (uint32_t x = begin * half ; x < end * half ; x = x + half)
+          {
+            //Only the diamonds on the border of the map miss corners
+            bool border_row = (x == 0) or (x == size - 1);
+
+            for (uint32_t y = half - x % step ; y < size ; y = y + step)
+            {
+              uint16_t mean;
+
+              if (border_row or (y == 0) or (y == size - 1))
+              {
+                //center value equal the mean of the diamond corners, the corners outside of the map are ignored
+                int32_t top = (y >= half) ? heights(x, y - half) : -1;
+                int32_t right = (x + half < size) ? heights(x + half, y) : -1;
+                int32_t bottom = (y + half < size) ? heights(x, y + half) : -1;
+                int32_t left = (x >= half) ? heights(x - half, y) : -1;
+                mean = average(top, right, bottom, left);
+              }
+              else
+              {
+                mean = (uint32_t(heights(x, y - half)) + heights(x + half, y) + heights(x, y + half) + heights(x - half, y)) / 4;
+              }
+
+              heights(x, y) = mean + height_offset(square_size, x, y);
+            }
+          }
+
+          //The rows of the last level are final
+          if (square_size == 3)
+          {
+            heights.flush(begin * half, (end - begin) * half);
+          }
+        });
+      }
+    }
+
+    //! Random offset added to a point computed by the diamond-square algorithm, proportional to the size of the square.
+    //! The height is stored on 16 bits, so a negative offset wraps exactly like an unsigned addition.
+    uint16_t height_offset(uint32_t square_size, uint32_t x, uint32_t y)
+    {
+      int32_t amplitude = Config::get().roughness * square_size;
+
+      return random_range(random_hash(seed, square_size, x, y), -amplitude, amplitude);
+    }
+
+    //! Smooth the eight of the terrain, more pass are done on water for a more realistic result
+    //! Based on http://www.lighthouse3d.com/opengl/terrain/index.php3?smoothing
+    //! Each pass blends every pixel with its already smoothed neighbour in the four directions. The sweeps along x process
+    //! whole rows with SIMD, the sweeps along y work on transposed tiles of rows, and both are split across the threads.
+    void height_smooth()
+    {
+      Stage_timer stage("Smoothing height map", uint64_t(Config::get().smooth_pass));
+
+      Smooth_weights weights(Config::get().smooth_factor);
+
+      for (uint32_t pass = 0 ; pass < Config::get().smooth_pass ; pass++)
+      {
+        stage.advance();
+
+        // Rows, left to right
+        smooth_rows(weights, true);
+
+        // Rows, right to left
+        smooth_rows(weights, false);
+
+        // Columns, bottom to top
+        smooth_columns(weights, true);
+
+        // Columns, top to bottom
+        smooth_columns(weights, false);
+      }
+    }
+
+    //! Smooth each row with the previous (or next) one. Every column is independent, the columns are split in chunks
+    //! processed by different threads, each thread walking its chunk down (or up) the map.
+    void smooth_rows(const Smooth_weights & weights, bool forward)
+    {
+      const uint32_t chunk = smooth_row_chunk;
+
+      Thread_pool::get().parallel_for(0, (size + chunk - 1) / chunk, [this, &weights, forward, chunk] (uint64_t begin, uint64_t end)
+      {
+        uint32_t first = begin * chunk;
+        uint32_t count = std::min<uint32_t>(end * chunk, size) - first;
+
+        for (uint32_t i = 1 ; i < size ; i++)
+        {
+          uint32_t x = forward ? i : size - 1 - i;
+          uint32_t neighbor = forward ? x - 1 : x + 1;
+
+          smooth_span(&_height[uint64_t(size) * neighbor + first], &_height[uint64_t(size) * x + first], count, weights);
+        }
+      });
+    }
+
+    //! Smooth each pixel with the previous (or next) one of its row. A block of rows is transposed tile by tile, so the
+    //! sequential dependency along a row is computed for all the rows of the block at once with SIMD.
+    void smooth_columns(const Smooth_weights & weights, bool forward)
+    {
+      const uint32_t block = smooth_column_block;
+
+      Thread_pool::get().parallel_for(0, (size + block - 1) / block, [this, &weights, forward, block] (uint64_t begin, uint64_t end)
+      {
+        uint16_t tile[smooth_column_tile + 1][smooth_column_block];
+
+        for (uint64_t index = begin ; index < end ; index++)
+        {
+          uint32_t first = index * block;
+          uint32_t rows = std::min(block, size - first);
+
+          //The first column of the sweep is not modified, it is the neighbour of the first tile
+          uint32_t start = forward ? 0 : size - 1;
+          for (uint32_t row = 0 ; row < rows ; row++)
+          {
+            tile[0][row] = _height[uint64_t(size) * (first + row) + start];
+          }
+
+          for (uint32_t done = 1 ; done < size ; done += smooth_column_tile)
+          {
+            uint32_t columns = std::min(smooth_column_tile, size - done);
+
+            for (uint32_t row = 0 ; row < rows ; row++)
+            {
+              const uint16_t * line = &_height[uint64_t(size) * (first + row)];
+              for (uint32_t i = 0 ; i < columns ; i++)
+              {
+                tile[i + 1][row] = line[forward ? done + i : size - 1 - done - i];
+              }
+            }
+
+            for (uint32_t i = 1 ; i <= columns ; i++)
+            {
+              smooth_span(tile[i - 1], tile[i], rows, weights);
+            }
+
+            for (uint32_t row = 0 ; row < rows ; row++)
+            {
+              uint16_t * line = &_height[uint64_t(size) * (first + row)];
+              for (uint32_t i = 0 ; i < columns ; i++)
+              {
+                line[forward ? done + i : size - 1 - done - i] = tile[i + 1][row];
+              }
+            }
+
+            //The last column of this tile is the neighbour of the next one
+            std::copy(tile[columns], tile[columns] + rows, tile[0]);
+          }
+
+          _height.flush(first, rows);
+        }
+      });
+    }
+
+    //! Fill _water with the rivers of the spring_max largest river systems. The rivers follow the drainage network of the
+    //! map, a pixel is part of a river when enough pixels drain through it, and the rivers get wider downstream.
+    void generate_rivers()
+    {
+      Stage_timer stage("Computing rivers", 4);
+
+      uint16_t ocean_height = Config::get().ocean_height;
+      Drainage drainage(_height, size, ocean_height, file_backed);
+
+      stage.advance();
+
+      //Number of pixels that must drain through a pixel to start a river
+      uint32_t threshold = std::max<double>(2, Config::get().river_area * size * size);
+
+      //Mouths of the rivers: land pixels draining in the sea or out of the map
+      std::vector<std::pair<uint32_t, uint64_t>> mouths;
+
+      for (uint64_t pixel = 0 ; pixel < uint64_t(size) * size ; pixel++)
+      {
+        if ((_height[pixel] >= ocean_height) and (drainage.accumulation(pixel) >= threshold)
+         and ((drainage.direction(pixel) == Drainage::outlet) or (_height[drainage.receiver(pixel)] < ocean_height)))
+        {
+          mouths.push_back(std::make_pair(drainage.accumulation(pixel), pixel));
+        }
+      }
+
+      //Keep the largest river systems
+      uint64_t kept = std::min<uint64_t>(Config::get().spring_max, mouths.size());
+      std::partial_sort(mouths.begin(), mouths.begin() + kept, mouths.end(), std::greater<std::pair<uint32_t, uint64_t>>());
+
+      Layer<uint8_t> state;
+      state.allocate(size, file_backed);
+
+      for (uint64_t i = 0 ; i < mouths.size() ; i++)
+      {
+        state[mouths[i].second] = (i < kept) ? river_kept : river_dropped;
+      }
+
+      stage.advance();
+
+      //The accumulation only grows downstream, so the pixels downstream of a river pixel are river pixels too and end at a
+      //mouth. Each river is walked once and the state of its mouth copied along it.
+      std::vector<uint64_t> path;
+
+      for (uint64_t pixel = 0 ; pixel < uint64_t(size) * size ; pixel++)
+      {
+        if ((state[pixel] != river_unknown) or (_height[pixel] < ocean_height) or (drainage.accumulation(pixel) < threshold))
+        {
+          continue;
+        }
+
+        uint64_t current = pixel;
+        while (state[current] == river_unknown)
+        {
+          path.push_back(current);
+          current = drainage.receiver(current);
+        }
+
+        for (uint64_t river : path)
+        {
+          state[river] = state[current];
+        }
+        path.clear();
+      }
+
+      stage.advance();
+
+      //Draw the rivers, their width grows with the square root of the number of pixels they drain
+      float rivers_size = Config::get().rivers_size;
+
+      for (uint64_t pixel = 0 ; pixel < uint64_t(size) * size ; pixel++)
+      {
+        if (state[pixel] != river_kept)
+        {
+          continue;
+        }
+
+        float flow = float(drainage.accumulation(pixel)) / threshold;
+        uint8_t power = std::min(255.0f, flow);
+        float radius = rivers_size * std::sqrt(flow) / 2;
+        int64_t reach = radius;
+
+        int64_t x = pixel / size;
+        int64_t y = pixel % size;
+
+        //The disc is clipped to the map once, instead of checking each of its pixels
+        for (int64_t dx = std::max(-reach, -x) ; dx <= std::min<int64_t>(reach, size - 1 - x) ; dx++)
+        {
+          for (int64_t dy = std::max(-reach, -y) ; dy <= std::min<int64_t>(reach, size - 1 - y) ; dy++)
+          {
+            uint64_t index = uint64_t(size) * (x + dx) + y + dy;
+
+            if ((dx * dx + dy * dy <= radius * radius) and (_height[index] >= ocean_height))
+            {
+              _water[index] = std::max(_water[index], power);
+            }
+          }
+        }
+      }
+    }
+
+    //! Fill _moisture from the distance of each pixel to the nearest water, ocean or river: 255 on the water, then divided by e
+    //! every Config::moisture_distance. The distance is an exact euclidean distance transform made of two linear passes: the
+    //! distance to the nearest water in the same column, then for each row the lower envelope of the parabolas centered on
+    //! its pixels (Felzenszwalb and Huttenlocher). The columns, then the rows, are split across the threads.
+    void generate_moisture()
+    {
+      Stage_timer stage("Computing moisture", 2);
+
+      uint16_t ocean_height = Config::get().ocean_height;
+
+      //Further than any pixel of the map, used when a column has no water
+      const uint32_t far = 2 * size;
+
+      //Distance of each pixel to the nearest water in its column
+      Layer<uint32_t> distances;
+      distances.allocate(size, file_backed);
+
+      const uint32_t block = moisture_column_block;
+
+      //A block of columns is scanned one row at a time, so the memory is still read in order
+      Thread_pool::get().parallel_for(0, (size + block - 1) / block, [this, &distances, ocean_height, far, block] (uint64_t begin, uint64_t end)
+      {
+        uint32_t last[moisture_column_block];
+
+        for (uint64_t index = begin ; index < end ; index++)
+        {
+          uint32_t first = index * block;
+          uint32_t columns = std::min(block, size - first);
+
+          //Nearest water above
+          std::fill(last, last + columns, far);
+          for (uint32_t x = 0 ; x < size ; x++)
+          {
+            uint64_t pixel = uint64_t(size) * x + first;
+            for (uint32_t i = 0 ; i < columns ; i++)
+            {
+              bool water = (_height[pixel + i] < ocean_height) or (_water[pixel + i] != 0);
+              last[i] = water ? 0 : std::min(last[i] + 1, far);
+              distances[pixel + i] = last[i];
+            }
+          }
+
+          //Nearest water below
+          std::fill(last, last + columns, far);
+          for (uint32_t x = size ; x-- > 0 ; )
+          {
+            uint64_t pixel = uint64_t(size) * x + first;
+            for (uint32_t i = 0 ; i < columns ; i++)
+            {
+              last[i] = (distances[pixel + i] == 0) ? 0 : std::min(last[i] + 1, far);
+              distances[pixel + i] = std::min(distances[pixel + i], last[i]);
+            }
+          }
+        }
+      });
+
+      stage.advance();
+
+      float decay = 1 / (Config::get().moisture_distance * size);
+
+      Thread_pool::get().parallel_for(0, size, [this, &distances, decay] (uint64_t begin, uint64_t end)
+      {
+        //Lower envelope of the parabolas of a row: the pixel of each parabola, and where the parabola starts to be the lowest
+        std::vector<uint32_t> parabolas(size);
+        std::vector<double> starts(size + 1);
+
+        for (uint32_t x = begin ; x < end ; x++)
+        {
+          const uint32_t * row = &distances[uint64_t(size) * x];
+          uint8_t * moisture = &_moisture[uint64_t(size) * x];
+
+          uint32_t count = 0;
+          parabolas[0] = 0;
+          starts[0] = -HUGE_VAL;
+          starts[1] = HUGE_VAL;
+
+          for (uint32_t y = 1 ; y < size ; y++)
+          {
+            double height = double(row[y]) * row[y] + double(y) * y;
+            double intersection;
+
+            //Drop the parabolas hidden by the new one, the first one starts at -infinity so it is never dropped
+            while (true)
             {
-              top = height(x, y - square_size / 2);
+              uint32_t other = parabolas[count];
+              intersection = (height - double(row[other]) * row[other] - double(other) * other) / (2.0 * (y - other));
+
+              if (intersection > starts[count])
+              {
+                break;
+              }
+              count--;
             }
-            
-            if (((x + square_size / 2 >= 0) and (x + square_size / 2 < size)) and ((y >= 0) and (y < size)))
+
+            count++;
+            parabolas[count] = y;
+            starts[count] = intersection;
+            starts[count + 1] = HUGE_VAL;
+          }
+
+          count = 0;
+          for (uint32_t y = 0 ; y < size ; y++)
+          {
+            while (starts[count + 1] < y)
             {
-              right = height(x + square_size / 2, y);
+              count++;
             }
-            
-            if (((x >= 0) and (x < size)) and ((y + square_size / 2 >= 0) and (y + square_size / 2 < size)))
+
+            uint32_t nearest = parabolas[count];
+            double offset = double(y) - nearest;
+            float distance = std::sqrt(offset * offset + double(row[nearest]) * row[nearest]);
+            moisture[y] = std::lround(255 * std::exp(-distance * decay));
+          }
+        }
+
+        _moisture.flush(begin, end - begin);
+      });
+    }
+
+    //! Sums over a part of the map of the quantities rating the site of a city
+    struct Site_sums
+    {
+      uint64_t land;      //!< Pixels above the sea level
+      uint64_t sea;       //!< Pixels under the sea level
+      uint64_t river;     //!< Pixels of river
+      uint64_t slope;     //!< Height differences with the right and bottom neighbors of the land pixels
+      uint64_t moisture;  //!< Moisture of the land pixels
+      uint64_t altitude;  //!< Height above the sea level of the land pixels
+
+      Site_sums operator+(const Site_sums & other) const
+      {
+        return {land + other.land, sea + other.sea, river + other.river, slope + other.slope, moisture + other.moisture,
+                altitude + other.altitude};
+      }
+
+      Site_sums operator-(const Site_sums & other) const
+      {
+        return {land - other.land, sea - other.sea, river - other.river, slope - other.slope, moisture - other.moisture,
+                altitude - other.altitude};
+      }
+    };
+
+    //! Place up to Config::city_max cities, at least Config::city_spacing apart, on the most suitable sites.
+    //! The sites are the blocks of city_block pixels. A site is rated on its neighbourhood: flat, low, moist, and close to a
+    //! river or to the sea. The sums over the neighbourhoods are read from summed-area tables of the blocks sums, so a rating
+    //! costs the same whatever the radius. The sites are then taken from the best to the worst and a site is dropped if a
+    //! city is already too close (greedy Poisson-disk sampling), which the grid of the city index answers in constant time.
+    void generate_cities()
+    {
+      Stage_timer stage("Computing cities", 4);
+
+      uint16_t ocean_height = Config::get().ocean_height;
+      const uint32_t block = city_block;
+      uint32_t blocks = (size + block - 1) / block;
+
+      //Summed-area table of the blocks: table[(blocks + 1) * (x + 1) + y + 1] sums the blocks [0, x] x [0, y]
+      std::vector<Site_sums> table(uint64_t(blocks + 1) * (blocks + 1), Site_sums{0, 0, 0, 0, 0, 0});
+
+      Thread_pool::get().parallel_for(0, blocks, [this, &table, ocean_height, block, blocks] (uint64_t begin, uint64_t end)
+      {
+        for (uint32_t block_x = begin ; block_x < end ; block_x++)
+        {
+          Site_sums * sums = &table[uint64_t(blocks + 1) * (block_x + 1) + 1];
+
+          for (uint32_t x = block_x * block ; x < std::min(size, (block_x + 1) * block) ; x++)
+          {
+            const uint16_t * row = &_height[uint64_t(size) * x];
+            const uint16_t * below = (x + 1 < size) ? row + size : row;
+            const uint8_t * water = &_water[uint64_t(size) * x];
+            const uint8_t * moisture = &_moisture[uint64_t(size) * x];
+
+            for (uint32_t y = 0 ; y < size ; y++)
             {
-              bottom = height(x, y + square_size / 2);
+              Site_sums & sum = sums[y / block];
+
+              if (row[y] < ocean_height)
+              {
+                sum.sea++;
+                continue;
+              }
+
+              uint32_t right = (y + 1 < size) ? row[y + 1] : row[y];
+              sum.land++;
+              sum.river += (water[y] != 0);
+              sum.slope += std::abs(int32_t(right) - row[y]) + std::abs(int32_t(below[y]) - row[y]);
+              sum.moisture += moisture[y];
+              sum.altitude += row[y] - ocean_height;
             }
-            
-            if (((x - square_size / 2 >= 0) and (x - square_size / 2 < size)) and ((y >= 0) and (y < size)))
+          }
+        }
+      });
+
+      stage.advance();
+
+      //The rows of the table are independent, then its columns
+      Thread_pool::get().parallel_for(1, blocks + 1, [&table, blocks] (uint64_t begin, uint64_t end)
+      {
+        for (uint64_t x = begin ; x < end ; x++)
+        {
+          for (uint32_t y = 1 ; y <= blocks ; y++)
+          {
+            table[(blocks + 1) * x + y] = table[(blocks + 1) * x + y] + table[(blocks + 1) * x + y - 1];
+          }
+        }
+      });
+      for (uint32_t x = 2 ; x <= blocks ; x++)
+      {
+        for (uint32_t y = 1 ; y <= blocks ; y++)
+        {
+          table[uint64_t(blocks + 1) * x + y] = table[uint64_t(blocks + 1) * x + y] + table[uint64_t(blocks + 1) * (x - 1) + y];
+        }
+      }
+
+      stage.advance();
+
+      //Rate the sites whose center is on dry land
+      int32_t radius = std::max<int32_t>(1, Config::get().city_radius * size / block + 0.5f);
+      const Site_sums & all = table.back();
+      double mean_slope = std::max<double>(1, double(all.slope) / std::max<uint64_t>(1, all.land));
+
+      std::vector<std::pair<float, uint32_t>> sites;
+      for (uint32_t block_x = 0 ; block_x < blocks ; block_x++)
+      {
+        for (uint32_t block_y = 0 ; block_y < blocks ; block_y++)
+        {
+          uint64_t center = uint64_t(size) * std::min(size - 1, block_x * block + block / 2) + std::min(size - 1, block_y * block + block / 2);
+          if ((_height[center] < ocean_height) or (_water[center] != 0))
+          {
+            continue;
+          }
+
+          uint32_t first_x = std::max(0, int32_t(block_x) - radius);
+          uint32_t first_y = std::max(0, int32_t(block_y) - radius);
+          uint32_t last_x = std::min<uint32_t>(blocks, block_x + radius + 1);
+          uint32_t last_y = std::min<uint32_t>(blocks, block_y + radius + 1);
+
+          Site_sums sums = table[uint64_t(blocks + 1) * last_x + last_y] - table[uint64_t(blocks + 1) * first_x + last_y]
+                         - table[uint64_t(blocks + 1) * last_x + first_y] + table[uint64_t(blocks + 1) * first_x + first_y];
+          uint64_t pixels = sums.land + sums.sea;
+
+          //Mostly submerged neighbourhoods are not rated
+          if (sums.land * 2 < pixels)
+          {
+            continue;
+          }
+
+          //A river is a few pixels wide, so a small part of the neighbourhood is enough to get the whole bonus
+          float flatness = 1 / (1 + sums.slope / (mean_slope * sums.land));
+          float water = std::min(1.0, 20.0 * sums.river / pixels) + std::min(0.5, 2.0 * sums.sea / pixels);
+          float moisture = sums.moisture / (255.0 * sums.land);
+          float lowland = 1 - sums.altitude / ((65536.0 - ocean_height) * sums.land);
+
+          //The random part only breaks the ties between equal sites
+          float jitter = random_range(random_hash(seed, 0, block_x, block_y), 0, 1024) / 1e6f;
+
+          sites.push_back(std::make_pair(flatness + water + moisture / 2 + lowland / 2 + jitter, uint32_t(blocks) * block_x + block_y));
+        }
+      }
+
+      stage.advance();
+
+      std::sort(sites.begin(), sites.end(), std::greater<std::pair<float, uint32_t>>());
+
+      float spacing = Config::get().city_spacing * size;
+      _cities = City_index(std::max(1.0f, spacing));
+
+      for (const std::pair<float, uint32_t> & site : sites)
+      {
+        if (_cities.size() >= Config::get().city_max)
+        {
+          break;
+        }
+
+        uint32_t x = std::min(size - 1, site.second / blocks * block + block / 2);
+        uint32_t y = std::min(size - 1, site.second % blocks * block + block / 2);
+
+        if (_cities.within(x, y, spacing).empty())
+        {
+          _cities.add(City{x, y, site.first});
+        }
+      }
+    }
+
+    //! Fill _road with roads linking the cities. The pairs of cities linked are the edges of the minimum spanning tree of
+    //! the cities, so every city is reached with the shortest total length of roads. Each road is the cheapest path over the
+    //! terrain (see Terrain_cost) found in a Road_graph, the roads are searched on several threads.
+    void generate_road()
+    {
+      //The spanning tree, the graph, then a step per road
+      Stage_timer stage("Computing roads", 1 + _cities.size());
+
+      //Prim algorithm on the distances between the cities
+      uint32_t count = _cities.size();
+      std::vector<std::pair<uint32_t, uint32_t>> pairs;
+      std::vector<float> distances(count, HUGE_VALF);
+      std::vector<uint32_t> closest(count, 0);
+      std::vector<bool> linked(count, false);
+
+      for (uint32_t city = 0 ; city < count ; )
+      {
+        linked[city] = true;
+        uint32_t next = count;
+
+        for (uint32_t other = 0 ; other < count ; other++)
+        {
+          if (linked[other])
+          {
+            continue;
+          }
+
+          float dx = float(_cities[other].x) - _cities[city].x;
+          float dy = float(_cities[other].y) - _cities[city].y;
+          if (dx * dx + dy * dy < distances[other])
+          {
+            distances[other] = dx * dx + dy * dy;
+            closest[other] = city;
+          }
+
+          if ((next == count) or (distances[other] < distances[next]))
+          {
+            next = other;
+          }
+        }
+
+        if (next < count)
+        {
+          pairs.push_back(std::make_pair(closest[next], next));
+        }
+        city = next;
+      }
+
+      stage.advance();
+
+      Terrain_cost terrain(_height, _water, size, Config::get().ocean_height);
+      Road_graph graph(terrain);
+
+      stage.advance();
+
+      //Each road is written by a single thread
+      std::vector<std::vector<uint64_t>> roads(pairs.size());
+
+      Thread_pool::get().parallel_for(0, pairs.size(), [this, &graph, &pairs, &roads, &stage] (uint64_t begin, uint64_t end)
+      {
+        Road_graph::Search search(graph);
+
+        for (uint64_t road = begin ; road < end ; road++)
+        {
+          const City & from = _cities[pairs[road].first];
+          const City & to = _cities[pairs[road].second];
+          search.path(uint64_t(size) * from.x + from.y, uint64_t(size) * to.x + to.y, roads[road]);
+          stage.advance();
+        }
+      });
+
+      for (const std::vector<uint64_t> & road : roads)
+      {
+        for (uint64_t pixel : road)
+        {
+          _road[pixel] = 1;
+        }
+      }
+    }
+
+    Layer<uint16_t> _height;  //Height of each pixel of the map
+    Layer<uint8_t> _water;  //Water power of each pixel, if not null, the pixel is river or lac (ocean is a completly different concept)
+    Layer<uint8_t> _moisture;  //Moisture of each pixel. 255 = ocean, river, lac,... 0 = desert.
+    Layer<uint8_t> _road;  //Not null on the pixels of a road
+    Layer<uint8_t> _shade;  //Shade of each pixel computed by shade(), see shade_color
+    Layer<uint16_t> _raw_height;  //Heights before smoothing, kept by update
+    uint64_t stage_keys[uint32_t(Map_stage::count)] = {0};  //Key of the output of each stage in the layers, see map_stage_keys
+    uint64_t raw_height_key = 0;  //Key of the heights in _raw_height, 0 if it is not up to date
+    Arena::Region region = {nullptr, 0};  //Memory of the layers, if they are not stored in files
+    uint8_t * file_memory = nullptr;  //Map file mapped in memory holding the layers, see load_file
+    uint64_t file_length = 0;
+    bool file_backed;  //The layers are stored in files, see Config::memory_budget
+    Light shade_light;  //Light used to compute _shade
+    bool shaded = false;  //_shade is computed for the current height map
+    Height_pyramid _pyramid;  //Quadtree of the heights, see height_pyramid
+    bool pyramid_built = false;  //_pyramid is computed for the current height map
+    uint32_t seed;  //Seed of the current map, each seed provide an unique map
+    City_index _cities;  //Cities of the map, see generate_cities
+    uint32_t size;    
+};
+
+const uint32_t Map::smooth_column_tile;
+
+//---------------------------------------------------------------//
+//                          Tile server                          //
+//---------------------------------------------------------------//
+
+//! Values bounded by their total cost, the least recently used ones are dropped first. The value of a key is made by the
+//! first thread asking for it, the threads asking for it meanwhile wait for this value instead of making it again.
+template <typename Key, typename Value>
+class Lru_cache
+{
+  public :
+    typedef std::shared_ptr<Value> Pointer;
+
+    //! How get found a value
+    enum class Outcome
+    {
+      hit,        //!< In the cache
+      coalesced,  //!< Being made by another thread
+      miss        //!< Made by the calling thread
+    };
+
+    Lru_cache(uint64_t capacity, std::function<uint64_t (const Value &)> cost) : capacity(capacity), cost(cost)
+    {
+    }
+
+    //! Value of the key, made by make if it is neither in the cache nor being made
+    Pointer get(const Key & key, const std::function<Pointer ()> & make, Outcome & outcome)
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+
+      typename std::unordered_map<Key, Entry>::iterator found = entries.find(key);
+
+      if (found != entries.end())
+      {
+        if (found->second.ready)
+        {
+          order.splice(order.begin(), order, found->second.position);
+          outcome = Outcome::hit;
+        }
+        else
+        {
+          outcome = Outcome::coalesced;
+        }
+
+        std::shared_future<Pointer> value = found->second.value;
+        lock.unlock();
+        return value.get();
+      }
+
+      std::promise<Pointer> promise;
+      entries[key] = Entry{promise.get_future().share(), order.end(), 0, false};
+      outcome = Outcome::miss;
+      lock.unlock();
+
+      Pointer value = make();
+
+      lock.lock();
+      Entry & entry = entries[key];
+      order.push_front(key);
+      entry.position = order.begin();
+      entry.cost = cost(*value);
+      entry.ready = true;
+      used += entry.cost;
+
+      //The new value stays even if it is larger than the capacity
+      while ((used > capacity) and (order.size() > 1))
+      {
+        typename std::unordered_map<Key, Entry>::iterator oldest = entries.find(order.back());
+        used -= oldest->second.cost;
+        entries.erase(oldest);
+        order.pop_back();
+      }
+      lock.unlock();
+
+      promise.set_value(value);
+      return value;
+    }
+
+    //! Total cost of the values in the cache
+    uint64_t cost_used()
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      return used;
+    }
+
+    //! Number of values in the cache
+    uint64_t count()
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      return order.size();
+    }
+
+  private :
+    Lru_cache(const Lru_cache &rhs);
+    Lru_cache &operator=(const Lru_cache &rhs);
+
+    struct Entry
+    {
+      std::shared_future<Pointer> value;
+      typename std::list<Key>::iterator position;  //Position in order, once ready
+      uint64_t cost;
+      bool ready;
+    };
+
+    uint64_t capacity;
+    std::function<uint64_t (const Value &)> cost;
+
+    std::mutex mutex;
+    std::unordered_map<Key, Entry> entries;
+    std::list<Key> order;  //Keys of the values, the most recently used first
+    uint64_t used = 0;
+};
+
+//! HTTP server rendering the tiles of the maps on demand, for web viewers. The tiles are the ones of Map::save_tiles:
+//! GET /<picker>/<seed>/<z>/<x>/<y>.ppm, picker being topographic or biome. GET /stats returns the counters of the cache
+//! and the latency of the tiles in JSON.
+//! The maps of the last seeds asked are kept in memory (Config::server_maps) and the encoded tiles in a cache of
+//! Config::tile_cache_bytes. The tiles of the last zoom level are rendered from the map, the others are reduced from the
+//! four tiles below them, through the cache. Concurrent requests for a tile or a map wait for the first one.
+class Tile_server
+{
+  public :
+    typedef std::vector<uint8_t> Tile;
+
+    Tile_server() :
+      maps(Config::get().server_maps, [] (const Map &) { return 1; }),
+      tiles(Config::get().tile_cache_bytes, [] (const Tile & tile) { return tile.size(); }),
+      widths(Map::tile_widths(Map::configured_size(), Config::get().tile_size)),
+      header(Map::tile_header()),
+      latencies(latency_samples)
+    {
+      uint32_t tile = Config::get().tile_size;
+      if ((tile < 2) or not is_power_of_two(tile))
+      {
+        printf("Error : The tile size %u is not a power of two\n", tile);
+        exit(1);
+      }
+    }
+
+    //! Answer the requests until the process is killed
+    void run()
+    {
+      listener = listen_socket();
+
+      std::vector<std::thread> threads;
+      for (uint32_t i = 1 ; i < std::max(1u, Config::get().server_threads) ; i++)
+      {
+        threads.push_back(std::thread(&Tile_server::serve, this));
+      }
+      serve();
+
+      for (std::thread & thread : threads)
+      {
+        thread.join();
+      }
+    }
+
+  private :
+    Tile_server(const Tile_server &rhs);
+    Tile_server &operator=(const Tile_server &rhs);
+
+    //! Latencies kept to compute the percentiles of /stats
+    static const uint32_t latency_samples = 10000;
+
+    //! Largest request read
+    static const uint32_t request_max = 8192;
+
+    //! Listening socket on Config::server_socket or on localhost:Config::server_port
+    int listen_socket()
+    {
+      const Config & config = Config::get();
+      int server;
+
+      if (not config.server_socket.empty())
+      {
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+
+        if (config.server_socket.size() >= sizeof(address.sun_path))
+        {
+          printf("Error : The socket path %s is too long\n", config.server_socket.c_str());
+          exit(1);
+        }
+        strcpy(address.sun_path, config.server_socket.c_str());
+        unlink(address.sun_path);
+
+        server = socket(AF_UNIX, SOCK_STREAM, 0);
+        if ((server < 0) or (bind(server, (const sockaddr *)&address, sizeof(address)) != 0))
+        {
+          printf("Error : Cannot listen on %s\n", config.server_socket.c_str());
+          exit(1);
+        }
+        printf("Serving tiles on %s\n", config.server_socket.c_str());
+      }
+      else
+      {
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons(config.server_port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        int reuse = 1;
+        server = socket(AF_INET, SOCK_STREAM, 0);
+        if ((server < 0) or (setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0)
+         or (bind(server, (const sockaddr *)&address, sizeof(address)) != 0))
+        {
+          printf("Error : Cannot listen on port %u\n", config.server_port);
+          exit(1);
+        }
+        printf("Serving tiles on http://localhost:%u\n", config.server_port);
+      }
+
+      if (listen(server, 128) != 0)
+      {
+        printf("Error : Cannot listen for connections\n");
+        exit(1);
+      }
+
+      return server;
+    }
+
+    //! Main loop of the threads of the server, a request per connection
+    void serve()
+    {
+      //The stages of the maps generated by the threads would mix their progress on the console
+      Progress::quiet = true;
+
+      while (true)
+      {
+        int client = accept(listener, nullptr, nullptr);
+
+        if (client >= 0)
+        {
+          answer(client);
+          close(client);
+        }
+      }
+    }
+
+    //! Read a request and send its answer
+    void answer(int client)
+    {
+      std::string request;
+      char buffer[1024];
+
+      while ((request.find("\r\n\r\n") == std::string::npos) and (request.size() < request_max))
+      {
+        ssize_t length = recv(client, buffer, sizeof(buffer), 0);
+        if (length <= 0)
+        {
+          return;
+        }
+        request.append(buffer, length);
+      }
+
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+      char path[256];
+      if ((sscanf(request.c_str(), "GET %255s HTTP/1.%*c", path) != 1))
+      {
+        send_answer(client, "400 Bad Request", "text/plain", "Bad request\n");
+        return;
+      }
+
+      if (strcmp(path, "/stats") == 0)
+      {
+        send_answer(client, "200 OK", "application/json", stats());
+        return;
+      }
+
+      char picker_name[32];
+      uint32_t seed, zoom, column, band;
+      int parsed = 0;
+
+      if ((sscanf(path, "/%31[a-z]/%u/%u/%u/%u.ppm%n", picker_name, &seed, &zoom, &column, &band, &parsed) != 5)
+       or (path[parsed] != '\0') or (picker(picker_name) == nullptr) or (zoom >= widths.size()))
+      {
+        send_answer(client, "404 Not Found", "text/plain", "No such tile\n");
+        return;
+      }
+
+      uint32_t level = widths.size() - 1 - zoom;
+      uint32_t tile_count = (widths[level] + Config::get().tile_size - 1) / Config::get().tile_size;
+
+      if ((column >= tile_count) or (band >= tile_count))
+      {
+        send_answer(client, "404 Not Found", "text/plain", "No such tile\n");
+        return;
+      }
+
+      std::shared_ptr<Tile> found = cached_tile(picker_name, seed, level, column, band);
+      send_answer(client, "200 OK", "image/x-portable-pixmap", std::string(found->begin(), found->end()));
+
+      std::lock_guard<std::mutex> lock(stats_mutex);
+      latencies[requests % latency_samples] = seconds_since(start);
+      requests++;
+    }
+
+    //! Send an answer and its body
+    void send_answer(int client, const char * status, const char * type, const std::string & body)
+    {
+      char answer_header[256];
+      snprintf(answer_header, sizeof(answer_header), "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %u\r\n"
+               "Connection: close\r\n\r\n", status, type, uint32_t(body.size()));
+
+      std::string answer = answer_header + body;
+      const char * data = answer.data();
+      uint64_t left = answer.size();
+
+      while (left > 0)
+      {
+        ssize_t sent = send(client, data, left, MSG_NOSIGNAL);
+        if (sent <= 0)
+        {
+          return;
+        }
+        data += sent;
+        left -= sent;
+      }
+    }
+
+    //! Color picker of a name of the requests, nullptr if it does not exist
+    const Color_picker * picker(const std::string & name) const
+    {
+      if (name == "topographic")
+      {
+        return &topographic_color_picker;
+      }
+      if (name == "biome")
+      {
+        return &biome_color_picker;
+      }
+      return nullptr;
+    }
+
+    //! Encoded tile of a level (0 for the pixels of the map) of a map, from the cache
+    std::shared_ptr<Tile> cached_tile(const std::string & picker_name, uint32_t seed, uint32_t level, uint32_t column, uint32_t band)
+    {
+      std::string key = picker_name + "/" + std::to_string(seed) + "/" + std::to_string(level) + "/" +
+                        std::to_string(column) + "/" + std::to_string(band);
+
+      Lru_cache<std::string, Tile>::Outcome outcome;
+      std::shared_ptr<Tile> found = tiles.get(key, [&] { return render(picker_name, seed, level, column, band); }, outcome);
+
+      std::lock_guard<std::mutex> lock(stats_mutex);
+      tile_outcomes[uint32_t(outcome)]++;
+      return found;
+    }
+
+    //! Render a tile: from the map for the level 0, from the four tiles below it for the others (see Map::save_tiles)
+    std::shared_ptr<Tile> render(const std::string & picker_name, uint32_t seed, uint32_t level, uint32_t column, uint32_t band)
+    {
+      uint32_t tile = Config::get().tile_size;
+
+      std::shared_ptr<Tile> encoded(new Tile(header.size() + uint64_t(tile) * tile * sizeof(Color)));
+      std::copy(header.begin(), header.end(), encoded->begin());
+      Color * colors = (Color *)(encoded->data() + header.size());
+
+      if (level == 0)
+      {
+        map(seed)->render_tile(picker(picker_name), column, band, colors);
+        return encoded;
+      }
+
+      //The four tiles below, side by side
+      uint32_t below = widths[level - 1];
+      std::vector<Color> children(uint64_t(4) * tile * tile);
+
+      for (uint32_t row = 0 ; row < 2 ; row++)
+      {
+        for (uint32_t side = 0 ; side < 2 ; side++)
+        {
+          if (((2 * band + row) * tile >= below) or ((2 * column + side) * tile >= below))
+          {
+            continue;
+          }
+
+          std::shared_ptr<Tile> child = cached_tile(picker_name, seed, level - 1, 2 * column + side, 2 * band + row);
+          const Color * child_colors = (const Color *)(child->data() + header.size());
+
+          for (uint32_t x = 0 ; x < tile ; x++)
+          {
+            std::copy(child_colors + uint64_t(tile) * x, child_colors + uint64_t(tile) * (x + 1),
+                      &children[uint64_t(2 * tile) * (row * tile + x) + side * tile]);
+          }
+        }
+      }
+
+      uint32_t width = std::min(2 * tile, below - 2 * column * tile);
+      uint32_t rows = std::min(2 * tile, below - 2 * band * tile);
+      uint32_t target_width = (width + 1) / 2;
+
+      std::vector<Color> reduced(uint64_t(target_width) * ((rows + 1) / 2));
+      Map::downsample(children.data(), 2 * tile, width, rows, reduced.data());
+
+      for (uint32_t x = 0 ; x < (rows + 1) / 2 ; x++)
+      {
+        std::copy(&reduced[uint64_t(target_width) * x], &reduced[uint64_t(target_width) * (x + 1)], colors + uint64_t(tile) * x);
+      }
+
+      return encoded;
+    }
+
+    //! Map of a seed, generated and shaded when it is not in memory
+    std::shared_ptr<Map> map(uint32_t seed)
+    {
+      Lru_cache<uint32_t, Map>::Outcome outcome;
+
+      return maps.get(seed, [seed] ()
+      {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        std::shared_ptr<Map> generated(new Map(Map::configured_size()));
+        generated->generate(seed);
+        generated->shade();
+
+        printf("Map of the seed %u generated in %.2f s\n", seed, seconds_since(start));
+        return generated;
+      }, outcome);
+    }
+
+    //! Counters of the server in JSON
+    std::string stats()
+    {
+      std::vector<double> samples;
+      uint64_t count;
+      uint64_t outcomes[3];
+
+      {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        count = requests;
+        samples.assign(latencies.begin(), latencies.begin() + std::min<uint64_t>(requests, latency_samples));
+        std::copy(tile_outcomes, tile_outcomes + 3, outcomes);
+      }
+
+      std::sort(samples.begin(), samples.end());
+
+      //Nearest rank
+      auto percentile = [&samples] (double rank)
+      {
+        return samples.empty() ? 0.0 : samples[std::min<uint64_t>(samples.size() - 1, rank * samples.size())] * 1000;
+      };
+
+      char json[512];
+      snprintf(json, sizeof(json), "{\"tile_requests\": %llu, \"tiles\": {\"hits\": %llu, \"coalesced\": %llu, \"misses\": %llu, "
+               "\"cached\": %llu, \"cached_bytes\": %llu, \"capacity_bytes\": %llu}, \"maps\": %llu, "
+               "\"latency_ms\": {\"samples\": %u, \"p50\": %.3f, \"p99\": %.3f}}\n",
+               (unsigned long long)count, (unsigned long long)outcomes[0], (unsigned long long)outcomes[1],
+               (unsigned long long)outcomes[2], (unsigned long long)tiles.count(), (unsigned long long)tiles.cost_used(),
+               (unsigned long long)Config::get().tile_cache_bytes, (unsigned long long)maps.count(),
+               uint32_t(samples.size()), percentile(0.5), percentile(0.99));
+      return json;
+    }
+
+    Topographic_color_picker topographic_color_picker{0, 65535};
+    Biome_color_picker biome_color_picker;
+
+    Lru_cache<uint32_t, Map> maps;
+    Lru_cache<std::string, Tile> tiles;
+    std::vector<uint32_t> widths;  //Pixels of each level, see Map::tile_widths
+    std::string header;  //Header of the encoded tiles
+    int listener = -1;
+
+    std::mutex stats_mutex;
+    std::vector<double> latencies;  //Seconds to answer the last tile requests, a ring
+    uint64_t requests = 0;
+    uint64_t tile_outcomes[3] = {0, 0, 0};  //Tiles found by Outcome
+};
+
+//---------------------------------------------------------------//
+//                           Benchmark                           //
+//---------------------------------------------------------------//
+
+#ifdef MAP_BENCHMARK
+
+//! Size of a file in bytes, 0 if it does not exist
+uint64_t file_size(std::string name)
+{
+  struct stat info;
+
+  if (stat(name.c_str(), &info) != 0)
+  {
+    return 0;
+  }
+  return info.st_size;
+}
+
+//! Compiler options of the build, recorded with the results (set by the Makefile)
+#ifndef MAP_BUILD_FLAGS
+#define MAP_BUILD_FLAGS "unknown"
+#endif
+
+//! Benchmarks of the map generator stages, friend of Map to be able to run the stages one by one
+class Benchmark
+{
+  public :
+    //! Time Map::save in every image format and output mode and report the size of the produced files
+    static void save(Map & map, const Color_picker * color_picker, const char * picker_name)
+    {
+      struct Mode
+      {
+        const char * name;
+        Image_format format;
+        Image_output output;
+        bool height_map;
+      };
+
+      const Mode modes[] = {
+        {"P3",        Image_format::ascii,  Image_output::buffered,   false},
+        {"P6",        Image_format::binary, Image_output::buffered,   false},
+        {"P6 mmap",   Image_format::binary, Image_output::memory_map, false},
+        {"P5",        Image_format::binary, Image_output::buffered,   true},
+        {"P5 mmap",   Image_format::binary, Image_output::memory_map, true},
+        {"P6 pipe",   Image_format::binary, Image_output::pipelined,  false},
+        {"P5 pipe",   Image_format::binary, Image_output::pipelined,  true}
+      };
+
+      Image_format format = Config::get().image_format;
+      Image_output output = Config::get().image_output;
+
+      //The shade is computed by the first save and reused by the others, do not time it
+      map.shade();
+
+      printf("\n%-12s %-10s %14s %10s %12s %12s\n", "picker", "format", "bytes", "seconds", "MB/s", "Mpixel/s");
+
+      for (const Mode & mode : modes)
+      {
+        Config::get().image_format = mode.format;
+        Config::get().image_output = mode.output;
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (mode.height_map)
+        {
+          map.save_height_map("benchmark");
+        }
+        else
+        {
+          map.save(color_picker, "benchmark");
+        }
+        double elapsed = seconds_since(start);
+
+        uint64_t bytes = file_size(mode.height_map ? "benchmark.pgm" : "benchmark.ppm");
+        printf("%-12s %-10s %14llu %10.3f %12.1f %12.1f\n", mode.height_map ? "height" : picker_name, mode.name,
+               (unsigned long long)bytes, elapsed, bytes / elapsed / 1e6, double(map.size) * map.size / elapsed / 1e6);
+      }
+
+      Config::get().image_format = format;
+      Config::get().image_output = output;
+
+      remove("benchmark.ppm");
+      remove("benchmark.pgm");
+    }
+
+    //! Time the shading of a map of the given size with and without ambient occlusion, twice each, and check that shading
+    //! the same map again produces the same shade buffer
+    static void shade(uint32_t size)
+    {
+      bool ambient_occlusion = Config::get().ambient_occlusion;
+
+      Map map(size);
+      map.generate_height();
+      map.height_smooth();
+
+      printf("\n%-8s %-10s %6s %10s %12s %18s\n", "size", "occlusion", "run", "seconds", "Mpixel/s", "checksum");
+
+      for (bool occlusion : {false, true})
+      {
+        Config::get().ambient_occlusion = occlusion;
+        uint64_t reference = 0;
+
+        for (uint32_t run = 0 ; run < 2 ; run++)
+        {
+          //Force the shading, the light did not change
+          map.shaded = false;
+
+          std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+          map.shade();
+          double elapsed = seconds_since(start);
+
+          uint64_t checksum = shade_checksum(map);
+          if (run == 0)
+          {
+            reference = checksum;
+          }
+
+          printf("%-8u %-10s %6u %10.3f %12.1f %18llx%s\n", size, occlusion ? "yes" : "no", run, elapsed,
+                 double(size) * size / elapsed / 1e6, (unsigned long long)checksum, (checksum == reference) ? "" : " MISMATCH");
+        }
+      }
+
+      Config::get().ambient_occlusion = ambient_occlusion;
+    }
+
+    //! Time the diamond-square algorithm with 1 to N threads and check that every run produces the same height map
+    static void generate_height(Map & map)
+    {
+      uint32_t thread_counts[] = {1, 2, 4, 8, 16, 32, 48, 64};
+      uint64_t reference = 0;
+
+      printf("\n%-8s %10s %12s %18s\n", "threads", "seconds", "Mpixel/s", "checksum");
+
+      for (uint32_t threads : thread_counts)
+      {
+        if ((threads > 1) and (threads > 2 * std::thread::hardware_concurrency()))
+        {
+          break;
+        }
+
+        Thread_pool::get().resize(threads);
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        map.generate_height();
+        double elapsed = seconds_since(start);
+
+        uint64_t checksum = height_checksum(map);
+        if (threads == 1)
+        {
+          reference = checksum;
+        }
+
+        printf("%-8u %10.3f %12.1f %18llx%s\n", threads, elapsed, double(map.size) * map.size / elapsed / 1e6,
+               (unsigned long long)checksum, (checksum == reference) ? "" : " MISMATCH");
+      }
+
+      Thread_pool::get().resize(Config::get().threads);
+    }
+
+    //! Time the diamond-square algorithm on height layers stored in each layout, and the copy of the result to the row major
+    //! layout of the map. Check that every layout produces the same height map.
+    static void layouts(std::vector<uint32_t> sizes)
+    {
+      printf("\n%-8s %-10s %10s %12s %10s %18s\n", "size", "layout", "seconds", "Mpixel/s", "copy", "checksum");
+
+      for (uint32_t size : sizes)
+      {
+        Map map(size);
+        uint64_t reference = diamond_square<Row_major>(map, "row major", 0);
+        diamond_square<Tiled>(map, "tiled", reference);
+        diamond_square<Morton>(map, "morton", reference);
+      }
+    }
+
+    //! Time the diamond-square heights against the fbm heights with the kernels of each SIMD level supported by the
+    //! processor, on maps of the given sizes and of the size below them (not a power of two plus one, fbm only). Check that
+    //! every kernel produces the same height map.
+    static void height_engines(std::vector<uint32_t> sizes)
+    {
+      const char * level_names[] = {"scalar", "sse4.1", "avx2", "avx512"};
+      Config & config = Config::get();
+      Height_engine height_engine = config.height_engine;
+      Simd_level simd_level = config.simd_level;
+
+      printf("\n%-8s %-16s %8s %10s %12s %10s %18s\n", "size", "engine", "threads", "seconds", "Mpixel/s", "speedup",
+             "checksum");
+
+      for (uint32_t size : sizes)
+      {
+        for (uint32_t map_size : {size, size - 1})
+        {
+          Map map(map_size);
+          double reference_time = 0;
+          uint64_t reference = 0;
+
+          if (is_power_of_two(map_size - 1))
+          {
+            config.height_engine = Height_engine::diamond_square;
+
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            map.generate_height();
+            reference_time = seconds_since(start);
+
+            printf("%-8u %-16s %8u %10.3f %12.1f %10s %18llx\n", map_size, "diamond-square", Thread_pool::get().size(),
+                   reference_time, double(map_size) * map_size / reference_time / 1e6, "",
+                   (unsigned long long)height_checksum(map));
+          }
+
+          config.height_engine = Height_engine::fbm;
+
+          for (uint32_t level = 0 ; level <= uint32_t(cpu_simd_level()) ; level++)
+          {
+            config.simd_level = Simd_level(level);
+
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            map.generate_height();
+            double elapsed = seconds_since(start);
+
+            uint64_t checksum = height_checksum(map);
+            if (level == 0)
             {
-              left = height(x - square_size / 2, y);
+              reference = checksum;
             }
-            
-            height(x, y, average(top, right, bottom, left) + offset);
+
+            std::string engine = std::string("fbm ") + level_names[level];
+            std::string speedup = (reference_time > 0) ? std::to_string(reference_time / elapsed).substr(0, 5) : "";
+
+            printf("%-8u %-16s %8u %10.3f %12.1f %10s %18llx%s\n", map_size, engine.c_str(), Thread_pool::get().size(),
+                   elapsed, double(map_size) * map_size / elapsed / 1e6, speedup.c_str(), (unsigned long long)checksum,
+                   (checksum == reference) ? "" : " MISMATCH");
           }
         }
       }
-      
-      Spinner::remove();
-      printf("done\n");
+
+      config.height_engine = height_engine;
+      config.simd_level = simd_level;
     }
 
-    //! Used by height_smooth
-    void height_smooth_pixel(uint16_t current_x, uint16_t current_y, uint16_t neighbor_x, uint16_t neighbor_y)
+    //! Time the smoothing of height maps of the given sizes, on all the threads of the pool
+    static void height_smooth(std::vector<uint32_t> sizes, uint32_t passes)
     {
-      int32_t current_height = height(current_x, current_y);
-      int32_t neighbor_height = height(neighbor_x, neighbor_y);
+      float smooth_pass = Config::get().smooth_pass;
+      Config::get().smooth_pass = passes;
 
-      float smooth_factor = Config::get().smooth_factor;
+      printf("\n%-8s %8s %10s %10s %12s\n", "size", "threads", "seconds", "passes/s", "Mpixel/s");
 
-      if (neighbor_height != -1)
+      for (uint32_t size : sizes)
       {
-        height(current_x, current_y, neighbor_height * (1.0 - smooth_factor) + current_height * smooth_factor);
+        Map map(size);
+        map.generate_height();
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        map.height_smooth();
+        double elapsed = seconds_since(start);
+
+        printf("%-8u %8u %10.3f %10.2f %12.1f\n", size, Thread_pool::get().size(), elapsed, passes / elapsed,
+               double(size) * size * passes / elapsed / 1e6);
       }
+
+      Config::get().smooth_pass = smooth_pass;
     }
 
-    //! Smooth the eight of the terrain, more pass are done on water for a more realistic result
-    //! Based on http://www.lighthouse3d.com/opengl/terrain/index.php3?smoothing
-    void height_smooth()
+    //! Time the placement of up to city_max cities on a map of the given size
+    static void generate_cities(uint32_t size, uint32_t city_max, float city_spacing)
+    {
+      uint32_t previous_max = Config::get().city_max;
+      float previous_spacing = Config::get().city_spacing;
+      Config::get().city_max = city_max;
+      Config::get().city_spacing = city_spacing;
+
+      Map map(size);
+      map.generate_height();
+      map.height_smooth();
+      map.generate_rivers();
+      map.generate_moisture();
+
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      map.generate_cities();
+      double elapsed = seconds_since(start);
+
+      printf("\n%-8s %8s %10s %12s\n", "size", "cities", "seconds", "Mpixel/s");
+      printf("%-8u %8u %10.3f %12.1f\n", size, map.cities().size(), elapsed, double(size) * size / elapsed / 1e6);
+
+      Config::get().city_max = previous_max;
+      Config::get().city_spacing = previous_spacing;
+    }
+
+    //! Time the roads between the cities of a map of the given size, on all the threads of the pool
+    static void generate_road(uint32_t size)
     {
-      printf("Smoothing height map...");
-      Spinner::add();
+      Map map(size);
+      map.generate_height();
+      map.height_smooth();
+      map.generate_rivers();
+      map.generate_moisture();
+      map.generate_cities();
 
-      for (uint8_t pass = 0 ; pass < Config::get().smooth_pass ; pass++)
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      map.generate_road();
+      double elapsed = seconds_since(start);
+
+      uint64_t pixels = 0;
+      for (uint64_t i = 0 ; i < uint64_t(size) * size ; i++)
       {
-        // Rows, left to right
-        for (uint32_t x = 0 ; x < size ; x++)
+        pixels += (map._road[i] != 0);
+      }
+
+      printf("\n%-8s %8s %8s %12s %10s\n", "size", "threads", "cities", "road pixels", "seconds");
+      printf("%-8u %8u %8u %12llu %10.3f\n", size, Thread_pool::get().size(), map.cities().size(), (unsigned long long)pixels, elapsed);
+    }
+
+    //! Time Map::update after tuning one parameter at a time, as an interactive tool would, and report the stages run
+    static void update(uint32_t size)
+    {
+      struct Tuning
+      {
+        const char * name;
+        std::function<void (Config &)> apply;
+      };
+
+      const Tuning tunings[] = {
+        {"road_river_cost",   [] (Config & config) { config.road_river_cost *= 2; }},
+        {"city_max",          [] (Config & config) { config.city_max /= 2; }},
+        {"moisture_distance", [] (Config & config) { config.moisture_distance *= 2; }},
+        {"rivers_size",       [] (Config & config) { config.rivers_size *= 2; }},
+        {"ocean_height",      [] (Config & config) { config.ocean_height += 1000; }},
+        {"smooth_pass",       [] (Config & config) { config.smooth_pass /= 2; }},
+        {"roughness",         [] (Config & config) { config.roughness *= 2; }}
+      };
+
+      Config & config = Config::get();
+      float road_river_cost = config.road_river_cost, moisture_distance = config.moisture_distance;
+      float rivers_size = config.rivers_size, smooth_pass = config.smooth_pass, roughness = config.roughness;
+      uint32_t city_max = config.city_max, ocean_height = config.ocean_height;
+
+      Map map(size);
+
+      //The first update runs every stage and keeps the heights before smoothing
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      map.update();
+      double generation = seconds_since(start);
+
+      printf("\n%-8s %-18s %8s %10s %10s\n", "size", "parameter", "stages", "seconds", "speedup");
+
+      for (const Tuning & tuning : tunings)
+      {
+        tuning.apply(config);
+
+        start = std::chrono::steady_clock::now();
+        uint32_t stages = map.update();
+        double elapsed = seconds_since(start);
+
+        printf("%-8u %-18s %8u %10.3f %10.1f\n", size, tuning.name, stages, elapsed, generation / elapsed);
+      }
+
+      config.road_river_cost = road_river_cost;
+      config.moisture_distance = moisture_distance;
+      config.rivers_size = rivers_size;
+      config.smooth_pass = smooth_pass;
+      config.roughness = roughness;
+      config.city_max = city_max;
+      config.ocean_height = ocean_height;
+    }
+
+    //! Time the generation of a map against saving it in a map file, loading it back with and without checking the
+    //! checksums, and rendering the topographic map from the loaded layers. Check that the loaded layers are the same.
+    static void map_file(uint32_t size)
+    {
+      Topographic_color_picker topographic_color_picker(0, 65535);
+      bool checksums = Config::get().map_file_checksums;
+
+      printf("\n%-8s %-22s %10s %12s\n", "size", "stage", "seconds", "Mpixel/s");
+
+      auto report = [size] (const char * stage, double elapsed)
+      {
+        printf("%-8u %-22s %10.3f %12.1f\n", size, stage, elapsed, double(size) * size / elapsed / 1e6);
+      };
+
+      Map map(size);
+
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      map.generate(Config::get().seed);
+      report("generate", seconds_since(start));
+
+      start = std::chrono::steady_clock::now();
+      map.save_file("benchmark.map");
+      report("save file", seconds_since(start));
+
+      for (bool check : {true, false})
+      {
+        Config::get().map_file_checksums = check;
+
+        Map loaded(size);
+
+        start = std::chrono::steady_clock::now();
+        if (not loaded.load_file("benchmark.map", size))
         {
-          Spinner::update();
+          printf("Error : Cannot load benchmark.map\n");
+          exit(1);
+        }
+        report(check ? "load file, checksums" : "load file", seconds_since(start));
 
-          for (uint32_t y = 0 ; y < size ; y++)
-          {
-            height_smooth_pixel(x, y, x - 1, y);
-          }
+        start = std::chrono::steady_clock::now();
+        loaded.save(&topographic_color_picker, "benchmark");
+        report("render loaded map", seconds_since(start));
+
+        uint64_t pixels = uint64_t(size) * size;
+        bool same = (memcmp(map._height.data(), loaded._height.data(), pixels * sizeof(uint16_t)) == 0)
+                    and (memcmp(map._water.data(), loaded._water.data(), pixels) == 0)
+                    and (memcmp(map._moisture.data(), loaded._moisture.data(), pixels) == 0)
+                    and (memcmp(map._road.data(), loaded._road.data(), pixels) == 0)
+                    and (map.cities().size() == loaded.cities().size());
+
+        if (not same)
+        {
+          printf("%-8u MISMATCH between the generated and the loaded layers\n", size);
         }
+      }
 
-        // Rows, right to left
-        for (uint32_t x = size - 1 ; x <= 0  ; x--)
+      Config::get().map_file_checksums = checksums;
+
+      remove("benchmark.map");
+      remove("benchmark.ppm");
+    }
+
+    //! Time the generation of world tiles and check that adjacent tiles share the same border
+    static void world_tiles(uint32_t tile_size, uint32_t tile_count)
+    {
+      World world;
+      bool seams = true;
+
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      for (uint32_t tile_x = 0 ; tile_x < tile_count ; tile_x++)
+      {
+        std::vector<uint16_t> previous;
+
+        for (uint32_t tile_y = 0 ; tile_y < tile_count ; tile_y++)
         {
-          Spinner::update();
+          std::vector<uint16_t> tile = world.tile(tile_x, tile_y, tile_size);
 
-          for (uint32_t y = 0 ; y < size ; y++)
+          for (uint32_t x = 0 ; (x <= tile_size) and not previous.empty() ; x++)
           {
-            height_smooth_pixel(x, y, x + 1, y);
+            seams = seams and (previous[(tile_size + 1) * x + tile_size] == tile[(tile_size + 1) * x]);
           }
+          previous.swap(tile);
         }
+      }
+      double elapsed = seconds_since(start);
 
-        // Columns, bottom to top
-        for (uint32_t x = 0 ; x < size ; x++)
+      printf("\n%-10s %10s %12s %10s\n", "tile", "tiles/s", "Mpixel/s", "seams");
+      printf("%-10u %10.1f %12.1f %10s\n", tile_size, tile_count * tile_count / elapsed,
+             double(tile_size + 1) * (tile_size + 1) * tile_count * tile_count / elapsed / 1e6, seams ? "ok" : "MISMATCH");
+    }
+
+    //! Time each stage of the generator, runs times, for every size and every thread count from 1 to the number of cores.
+    //! Report the median and the percentiles of the times of each stage and the peak memory of each configuration, on
+    //! the console and in a JSON file to compare builds and releases.
+    static void stages(const std::vector<uint32_t> & sizes, uint32_t runs, const char * json_name)
+    {
+      struct Stage
+      {
+        const char * name;
+        std::function<void (Map &)> run;
+      };
+
+      Topographic_color_picker topographic_color_picker(0, 65535);
+      Biome_color_picker biome_color_picker;
+
+      const Stage stages[] = {
+        {"height",           [] (Map & map) { map.generate_height(); }},
+        {"smooth",           [] (Map & map) { map.height_smooth(); }},
+        {"rivers",           [] (Map & map) { map.generate_rivers(); }},
+        {"moisture",         [] (Map & map) { map.generate_moisture(); }},
+        {"cities",           [] (Map & map) { map.generate_cities(); }},
+        {"road",             [] (Map & map) { map.generate_road(); }},
+        {"shade",            [] (Map & map) { map.shade(); }},
+        {"save topographic", [&] (Map & map) { map.save(&topographic_color_picker, "benchmark"); }},
+        {"save biome",       [&] (Map & map) { map.save(&biome_color_picker, "benchmark"); }},
+        {"save height",      [] (Map & map) { map.save_height_map("benchmark"); }},
+        {"save all",         [&] (Map & map)
+          {
+            map.save_images({{Image_content::colors, "benchmark_topographic", &topographic_color_picker},
+                             {Image_content::colors, "benchmark_biome", &biome_color_picker},
+                             {Image_content::height, "benchmark_height", nullptr},
+                             {Image_content::moisture, "benchmark_moisture", nullptr}});
+          }}
+      };
+      const uint32_t stage_count = sizeof(stages) / sizeof(stages[0]);
+
+      //Powers of two, and all the cores
+      uint32_t cores = std::max(1u, std::thread::hardware_concurrency());
+      std::vector<uint32_t> thread_counts;
+      for (uint32_t threads = 1 ; threads < cores ; threads *= 2)
+      {
+        thread_counts.push_back(threads);
+      }
+      thread_counts.push_back(cores);
+
+      FILE * json = fopen(json_name, "w");
+      if (json == nullptr)
+      {
+        printf("Error : Cannot open %s\n", json_name);
+        exit(1);
+      }
+
+      fprintf(json, "{\n  \"build\": {\"compiler\": \"%s\", \"flags\": \"%s\"},\n", __VERSION__, MAP_BUILD_FLAGS);
+      fprintf(json, "  \"hardware_threads\": %u,\n  \"runs\": %u,\n  \"results\": [", cores, runs);
+
+      printf("\n%-8s %8s %-17s %10s %10s %10s %12s\n", "size", "threads", "stage", "median", "p10", "p90", "Mpixel/s");
+
+      bool first_result = true;
+
+      //The output of the stages would be mixed with the results
+      Progress::quiet = true;
+
+      for (uint32_t size : sizes)
+      {
+        for (uint32_t threads : thread_counts)
         {
-          Spinner::update();
+          Thread_pool::get().resize(threads);
+          Arena::get().trim();
+          reset_peak_memory();
+
+          std::vector<std::vector<double>> times(stage_count);
 
-          for (uint32_t y = 0 ; y < size ; y++)
           {
-            height_smooth_pixel(x, y, x, y - 1);
+            Map map(size);
+
+            for (uint32_t run = 0 ; run < runs ; run++)
+            {
+              map.reset(Config::get().seed);
+
+              for (uint32_t stage = 0 ; stage < stage_count ; stage++)
+              {
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                stages[stage].run(map);
+                times[stage].push_back(seconds_since(start));
+              }
+            }
           }
-        }
 
-        // Columns, top to bottom
-        for (uint32_t x = 0 ; x < size ; x++)
-        {
-          Spinner::update();
+          uint64_t peak = peak_memory();
+
+          fprintf(json, "%s\n    {\"size\": %u, \"threads\": %u, \"peak_rss_bytes\": %llu, \"stages\": [", first_result ? "" : ",",
+                  size, threads, (unsigned long long)peak);
+          first_result = false;
 
-          for (uint32_t y = size - 1 ; y <= 0  ; y--)
+          for (uint32_t stage = 0 ; stage < stage_count ; stage++)
           {
-            height_smooth_pixel(x, y, x, y + 1);
+            std::vector<double> & stage_times = times[stage];
+            std::sort(stage_times.begin(), stage_times.end());
+
+            double median = percentile(stage_times, 50);
+            double pixels_per_second = double(size) * size / median;
+
+            printf("%-8u %8u %-17s %10.4f %10.4f %10.4f %12.1f\n", size, threads, stages[stage].name, median,
+                   percentile(stage_times, 10), percentile(stage_times, 90), pixels_per_second / 1e6);
+
+            fprintf(json, "%s\n      {\"name\": \"%s\", \"median\": %.6f, \"p10\": %.6f, \"p90\": %.6f, \"min\": %.6f, "
+                    "\"max\": %.6f, \"pixels_per_second\": %.0f}", (stage == 0) ? "" : ",", stages[stage].name, median,
+                    percentile(stage_times, 10), percentile(stage_times, 90), stage_times.front(), stage_times.back(),
+                    pixels_per_second);
           }
+
+          fprintf(json, "\n    ]}");
+          printf("%-8u %8u %-17s %10.1f MB\n", size, threads, "peak memory", peak / 1e6);
         }
       }
 
-      Spinner::remove();
-      printf("done\n");
+      fprintf(json, "\n  ]\n}\n");
+      fclose(json);
+
+      Progress::quiet = false;
+
+      Thread_pool::get().resize(Config::get().threads);
+
+      remove("benchmark.ppm");
+      remove("benchmark.pgm");
+      remove("benchmark_topographic.ppm");
+      remove("benchmark_biome.ppm");
+      remove("benchmark_height.pgm");
+      remove("benchmark_moisture.pgm");
     }
 
-    void generate_rivers()
+  private :
+    //! Time the diamond-square algorithm on a height layer in the Layout, return the checksum of the height map
+    template <typename Layout>
+    static uint64_t diamond_square(Map & map, const char * layout_name, uint64_t reference)
     {
-      printf("Computing rivers...");
-      Spinner::add();
-
-      uint32_t spring_count = randr(0, Config::get().spring_max);
+      Layer<uint16_t, Layout> heights;
+      heights.allocate(map.size, false);
 
-      for (uint32_t i = 0 ; i < spring_count ; i++)
+      double elapsed;
       {
-        Spinner::update();
-
-        //Compute the coordinates of the spring
-        uint16_t x = randr(0, size);
-        uint16_t y = randr(0, size);
+        Progress::quiet = true;
+        Stage_timer stage("Computing height map");
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        map.diamond_square(heights, stage);
+        elapsed = seconds_since(start);
+        Progress::quiet = false;
+      }
 
-        //If the spring is inside the ocean, skip it
-        if (height(x, y) < (int32_t)(Config::get().ocean_height))
+      //The stages after the height need the rows of the map
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      Thread_pool::get().parallel_for(0, map.size, [&map, &heights] (uint64_t begin, uint64_t end)
+      {
+        for (uint32_t x = begin ; x < end ; x++)
         {
-          continue;
+          for (uint32_t y = 0 ; y < map.size ; y++)
+          {
+            map._height[uint64_t(map.size) * x + y] = heights(x, y);
+          }
         }
+      });
+      double copy = seconds_since(start);
 
-        //TODO std::priority_queue<RiverElement> river;
-      }
-
-      Spinner::remove();
-      printf("done\n");
+      uint64_t checksum = height_checksum(map);
+      printf("%-8u %-10s %10.3f %12.1f %10.3f %18llx%s\n", map.size, layout_name, elapsed,
+             double(map.size) * map.size / elapsed / 1e6, copy, (unsigned long long)checksum,
+             ((reference == 0) or (checksum == reference)) ? "" : " MISMATCH");
+      return checksum;
     }
 
-    void generate_cities()
+    //! Value below which are p percents of the sorted values, the nearest one by rank
+    static double percentile(const std::vector<double> & sorted, uint32_t p)
     {
-      //TODO
+      return sorted[std::max<uint64_t>(1, (sorted.size() * p + 99) / 100) - 1];
     }
 
-    void generate_road()
+    //! Start measuring the peak memory from the current one. Supported by Linux only, elsewhere the peak of the process
+    //! is reported.
+    static void reset_peak_memory()
     {
-      //TODO
+      FILE * fp = fopen("/proc/self/clear_refs", "w");
+      if (fp != nullptr)
+      {
+        fputs("5", fp);
+        fclose(fp);
+      }
     }
 
-    //! \return height if x and y are inside the map, -1 otherwise
-    int32_t height(int32_t x, int32_t y)
+    //! Peak resident memory in bytes since reset_peak_memory
+    static uint64_t peak_memory()
     {
-      if ((x < size) and (y < size) and (x >= 0) and (y >= 0))
-      {
-        return _height[x + size * y];
-      }
-      else
+      FILE * fp = fopen("/proc/self/status", "r");
+      if (fp != nullptr)
       {
-        return -1;
+        char line[256];
+        unsigned long long kilobytes;
+
+        while (fgets(line, sizeof(line), fp) != nullptr)
+        {
+          if (sscanf(line, "VmHWM: %llu kB", &kilobytes) == 1)
+          {
+            fclose(fp);
+            return kilobytes * 1024;
+          }
+        }
+        fclose(fp);
       }
+
+      //Linux reports ru_maxrss in kilobytes
+      struct rusage usage;
+      getrusage(RUSAGE_SELF, &usage);
+      return uint64_t(usage.ru_maxrss) * 1024;
     }
-    
-    //! Set height if x and y are inside the map
-    void height(int32_t x, int32_t y, uint16_t value)
+
+    //! Hash of the whole height layer, used to compare the runs
+    static uint64_t height_checksum(const Map & map)
     {
-      if ((x < size) and (y < size) and (x >= 0) and (y >= 0))
+      uint64_t hash = 0;
+      for (uint64_t i = 0 ; i < uint64_t(map.size) * map.size ; i++)
       {
-        _height[x + size * y] = value;
+        hash = hash_mix(hash ^ map._height[i]);
       }
+      return hash;
     }
 
-    //! \return water if x and y are inside the map, -1 otherwise
-    int16_t water(int32_t x, int32_t y)
+    //! Hash of the whole shade buffer, used to compare the runs
+    static uint64_t shade_checksum(const Map & map)
     {
-      if ((x < size) and (y < size) and (x >= 0) and (y >= 0))
-      {
-        return _water[x + size * y];
-      }
-      else
+      uint64_t hash = 0;
+      for (uint64_t i = 0 ; i < uint64_t(map.size) * map.size ; i++)
       {
-        return -1;
+        hash = hash_mix(hash ^ map._shade[i]);
       }
+      return hash;
     }
+};
+
+//! Without argument, run the benchmarks of the stages on the configured map.
+//! "stages [file] [max size] [runs]" runs the stage suite on the sizes from 257 to max size (8193 by default) and writes
+//! its results in file (benchmark.json by default).
+int main (int argc, char ** argv)
+{
+  setbuf(stdout, NULL);
 
-    //! Set water if x and y are inside the map
-    void water(int32_t x, int32_t y, uint8_t value)
+  if ((argc > 1) and (strcmp(argv[1], "stages") == 0))
+  {
+    const char * json_name = (argc > 2) ? argv[2] : "benchmark.json";
+    uint32_t max_size = (argc > 3) ? strtoul(argv[3], nullptr, 10) : 8193;
+    uint32_t runs = (argc > 4) ? strtoul(argv[4], nullptr, 10) : 5;
+
+    std::vector<uint32_t> sizes;
+    for (uint32_t size = 257 ; size <= max_size ; size = 2 * size - 1)
     {
-      if ((x < size) and (y < size) and (x >= 0) and (y >= 0))
-      {
-        _water[x + size * y] = value;
-      }
+      sizes.push_back(size);
     }
 
-    //! \return moisture if x and y are inside the map, -1 otherwise
-    int16_t moisture(int32_t x, int32_t y)
+    if (sizes.empty() or (runs == 0))
     {
-      if ((x < size) and (y < size) and (x >= 0) and (y >= 0))
-      {
-        return _moisture[x + size * y];
-      }
-      else
-      {
-        return -1;
-      }
+      printf("Usage : %s stages [file] [max size] [runs]\n", argv[0]);
+      exit(1);
+    }
+
+    Benchmark::stages(sizes, runs, json_name);
+    return 0;
+  }
+
+  Map map;
+  Topographic_color_picker topographic_color_picker(0, 65535);
+  Biome_color_picker biome_color_picker;
+
+  Benchmark::generate_height(map);
+  Benchmark::layouts({2049, 8193});
+  Benchmark::height_engines({2049, 8193});
+  Benchmark::height_smooth({2049, 8193}, 4);
+  Benchmark::shade(4097);
+  Benchmark::generate_cities(8193, 5000, 0.005);
+  Benchmark::generate_road(2049);
+  Benchmark::world_tiles(512, 4);
+  Benchmark::map_file(8193);
+  Benchmark::update(4097);
+  Benchmark::save(map, &topographic_color_picker, "topographic");
+  Benchmark::save(map, &biome_color_picker, "biome");
+}
+
+#else
+
+//---------------------------------------------------------------//
+//                           Main loop                           //
+//---------------------------------------------------------------//
+
+//! Parse a list of seeds such as "1,5,10-20"
+static std::vector<uint32_t> parse_seeds(const char * text)
+{
+  std::vector<uint32_t> seeds;
+  const char * position = text;
+
+  while (true)
+  {
+    char * end;
+    unsigned long first = strtoul(position, &end, 10);
+    unsigned long last = first;
+
+    if ((end == position) or (first > UINT32_MAX))
+    {
+      break;
     }
 
-    //! Set moisture if x and y are inside the map
-    void moisture(int32_t x, int32_t y, uint8_t value)
+    position = end;
+
+    if (*position == '-')
     {
-      if ((x < size) and (y < size) and (x >= 0) and (y >= 0))
+      last = strtoul(position + 1, &end, 10);
+
+      if ((end == position + 1) or (last > UINT32_MAX) or (last < first))
       {
-        _moisture[x + size * y] = value;
+        break;
       }
+
+      position = end;
+    }
+
+    for (unsigned long seed = first ; seed <= last ; seed++)
+    {
+      seeds.push_back(uint32_t(seed));
+    }
+
+    if (*position == '\0')
+    {
+      return seeds;
     }
 
-    void lowest_neighbors (uint16_t & x, uint16_t & y)
+    if (*position != ',')
+    {
+      break;
+    }
+
+    position++;
+  }
+
+  printf("Error : Invalid seeds %s, expected a list such as 1,5,10-20\n", text);
+  exit(1);
+}
+
+//! Images asked by the configuration, their names end with the suffix
+static std::vector<Map_image> configured_images(const Color_picker * topographic_color_picker,
+                                                const Color_picker * biome_color_picker, const std::string & suffix)
+{
+  std::vector<Map_image> images;
+
+  if (Config::get().generate_topographic_map)
+  {
+    images.push_back({Image_content::colors, "topographic" + suffix, topographic_color_picker});
+  }
+
+  if (Config::get().generate_height_map)
+  {
+    images.push_back({Image_content::height, "height" + suffix, nullptr});
+  }
+
+  if (Config::get().generate_moisture_map)
+  {
+    images.push_back({Image_content::moisture, "moisture" + suffix, nullptr});
+  }
+
+  if (Config::get().generate_biome_map)
+  {
+    images.push_back({Image_content::colors, "biome" + suffix, biome_color_picker});
+  }
+
+  return images;
+}
+
+//! Generate and save a map for each seed. Each worker owns a map and generates its seeds one after another, running the
+//! stages on its own thread, so the layers are allocated once per worker and the color tables once for the whole batch.
+//! The number of workers is limited by the threads, and by Config::memory_budget when it is set.
+static void generate_maps(const std::vector<uint32_t> & seeds)
+{
+  uint32_t size = Map::configured_size();
+  uint64_t workers = std::min<uint64_t>(Thread_pool::get().size(), seeds.size());
+
+  uint64_t budget = Config::get().memory_budget;
+  if (budget != 0)
+  {
+    workers = std::max<uint64_t>(1, std::min<uint64_t>(workers, budget / Map::memory_per_map(size)));
+  }
+
+  printf("Generating %u maps of %u x %u pixels with %u workers\n", uint32_t(seeds.size()), size, size, uint32_t(workers));
+
+  //The color tables only depend on the configuration
+  Topographic_color_picker topographic_color_picker(0, 65535);
+  Biome_color_picker biome_color_picker;
+
+  std::atomic<uint64_t> next(0);
+  std::mutex print_mutex;
+  auto start = std::chrono::steady_clock::now();
+
+  Thread_pool::get().parallel_for(0, workers, [&] (uint64_t, uint64_t)
+  {
+    //The stages of the workers would mix their progress on the console
+    Progress::quiet = true;
+
+    Map map(size);
+
+    for (uint64_t i = next++ ; i < seeds.size() ; i = next++)
     {
-      uint16_t center_x = x;
-      uint16_t center_y = y;
+      uint32_t seed = seeds[i];
+      std::string suffix = "_" + std::to_string(seed);
 
-      int32_t height_min = -1;
+      map.generate(seed);
+      map.save_images(configured_images(&topographic_color_picker, &biome_color_picker, suffix));
 
-      for (int8_t dx = -1 ; dx <= 1 ; dx++)
+      if (Config::get().generate_tiles)
       {
-        for (int8_t dy = -1 ; dy <= 1 ; dy++)
-        {
-          if ((dx != 0) and (dy != 0))
-          {
-            if (height_min == -1)
-            {
-              height_min = height(center_x + dx, center_y + dy);
-              x = center_x + dx;
-              y = center_y + dy;
-            }
-            else if ((height(center_x + dx, center_y + dy) != -1) && (height(center_x + dx, center_y + dy) < height_min))
-            {
-              height_min = height(center_x + dx, center_y + dy);
-              x = center_x + dx;
-              y = center_y + dy;
-            }
-          }
-        }
+        map.save_tiles(&topographic_color_picker, "tiles" + suffix);
       }
+
+      std::lock_guard<std::mutex> lock(print_mutex);
+      printf("Seed %u done (%.2f s)\n", seed, seconds_since(start));
     }
-      
-    uint16_t * _height;  //Height of each pixel of the map
-    uint8_t * _water;  //Water power of each pixel, if not null, the pixel is river or lac (ocean is a completly different concept)
-    uint8_t * _moisture;  //Moisture of each pixel. 255 = ocean, river, lac,... 0 = desert.
-    uint16_t size;    
-};
 
-//---------------------------------------------------------------//
-//                           Main loop                           //
-//---------------------------------------------------------------//
+    Progress::quiet = false;
+  });
+
+  double seconds = seconds_since(start);
+  printf("%u maps in %.2f s, %.2f maps/s\n", uint32_t(seeds.size()), seconds, seeds.size() / seconds);
+}
 
-int main ()
+//! Without argument, generate the map of Config::seed. With a list of seeds such as "1,5,10-20", generate a map for
+//! each seed, suffixed by the seed. With serve, run the tile server (see Tile_server).
+int main (int argc, char ** argv)
 {    
   setbuf(stdout, NULL);
-    
-  // Initialize the random number generator with the seed provided by the configuration
-  srand(Config::get().seed);
-  
-  // Build the map
-  Map map;
-  
-  if (Config::get().generate_topographic_map)
+
+  if (argc > 2)
   {
-    // Generate the color picker that is used to generate the topographic map
-    Topographic_color_picker topographic_color_picker(0, 65535);
+    printf("Usage : %s [seeds | serve]\n", argv[0]);
+    exit(1);
+  }
 
-    // Save the topographic map
-    map.save(&topographic_color_picker, "topographic");
+  if ((argc == 2) and (strcmp(argv[1], "serve") == 0))
+  {
+    Tile_server server;
+    server.run();
+    return 0;
   }
-/* TODO
-  if (Config::get().generate_biome_map)
+
+  if (argc == 2)
   {
-    // Generate the color picker that is used to generate the biome map
-    Biome_color_picker biome_color_picker();
+    generate_maps(parse_seeds(argv[1]));
+    return 0;
+  }
 
-    // Save the topographic map
-    map.save(&biome_color_picker, std::string("biome"));
-  }*/
+  // Build the map
+  Map map;
+
+  // Generate the color pickers that are used to generate the topographic map and the biome map
+  Topographic_color_picker topographic_color_picker(0, 65535);
+  Biome_color_picker biome_color_picker;
+
+  // Save every image of the map in a single pass
+  map.save_images(configured_images(&topographic_color_picker, &biome_color_picker, ""));
+
+  if (Config::get().generate_tiles)
+  {
+    // Save the topographic map as tiles for the viewers
+    map.save_tiles(&topographic_color_picker, "tiles");
+  }
 }
+
+#endif